@@ -21,7 +21,13 @@ then
     has_dgpu=1
 fi
 
-sudo modprobe msr
+# The EC reads CPU power over PECI, msr is only needed for TCC and TJMAX
+has_msr=0
+if [ "${has_ec}" == "0" ]
+then
+    sudo modprobe msr
+    has_msr=1
+fi
 
 header=1
 if [ -e power.csv ]
@@ -42,8 +48,11 @@ do
         F="${F}\tCPU PL1"
         F="${F}\tCPU PL2"
         F="${F}\tCPU C"
-        F="${F}\tCPU TCC"
-        F="${F}\tCPU TJM"
+        if [ "${has_msr}" == "1" ]
+        then
+            F="${F}\tCPU TCC"
+            F="${F}\tCPU TJM"
+        fi
         if [ "${has_ec}" == "1" ]
         then
             F="${F}\tCPU FAN"
@@ -60,7 +69,10 @@ do
     else
         F="$(date "+%T")"
 
-        last_E="$(sudo cat /sys/class/powercap/intel-rapl\:0/energy_uj)"
+        if [ "${has_ec}" == "0" ]
+        then
+            last_E="$(sudo cat /sys/class/powercap/intel-rapl\:0/energy_uj)"
+        fi
         sleep 1
 
         if [ "${has_bat}" == "1" ]
@@ -73,8 +85,13 @@ do
             F="${F}\t$(printf "%.2f" "${bat_W}")"
         fi
 
-        E="$(sudo cat /sys/class/powercap/intel-rapl\:0/energy_uj)"
-        W="$(echo "(${E} - ${last_E})/1000000" | bc -lq)"
+        if [ "${has_ec}" == "1" ]
+        then
+            W="$(sudo tool/target/release/purism_ectool power)"
+        else
+            E="$(sudo cat /sys/class/powercap/intel-rapl\:0/energy_uj)"
+            W="$(echo "(${E} - ${last_E})/1000000" | bc -lq)"
+        fi
         F="${F}\t$(printf "%.1f" "${W}")"
 
         PL1_uW="$(sudo cat /sys/class/powercap/intel-rapl\:0/constraint_0_power_limit_uw)"
@@ -89,15 +106,18 @@ do
         C="$(echo "${T}/1000" | bc -lq)"
         F="${F}\t$(printf "%.1f" "${C}")"
 
-        TJMAX="$(sudo rdmsr -c 0x1A2 --bitfield 23:16)"
-        TCC_OFF="$(sudo rdmsr -c 0x1A2 --bitfield 31:24)"
-        TCC="$(python3 -c "print(hex(${TJMAX}-${TCC_OFF}))")"
-        F="${F}\t$(printf "%d" "${TCC}")"
-        F="${F}\t$(printf "%d" "${TJMAX}")"
+        if [ "${has_msr}" == "1" ]
+        then
+            TJMAX="$(sudo rdmsr -c 0x1A2 --bitfield 23:16)"
+            TCC_OFF="$(sudo rdmsr -c 0x1A2 --bitfield 31:24)"
+            TCC="$(python3 -c "print(hex(${TJMAX}-${TCC_OFF}))")"
+            F="${F}\t$(printf "%d" "${TCC}")"
+            F="${F}\t$(printf "%d" "${TJMAX}")"
+        fi
 
         if [ "${has_ec}" == "1" ]
         then
-            D="$(sudo tool/target/release/system76_ectool fan 0)"
+            D="$(sudo tool/target/release/purism_ectool fan 0)"
             P="$(echo "(${D} * 100)/255" | bc -lq)"
             F="${F}\t$(printf "%.0f" "${P}")"
         fi
@@ -112,7 +132,7 @@ do
 
             if [ "${has_ec}" == "1" ]
             then
-                D="$(sudo tool/target/release/system76_ectool fan 1)"
+                D="$(sudo tool/target/release/purism_ectool fan 1)"
                 P="$(echo "(${D} * 100)/255" | bc -lq)"
                 F="${F}\t$(printf "%.0f" "${P}")"
             fi
@@ -2,6 +2,7 @@
 
 #include <board/acpi.h>
 #include <board/battery.h>
+#include <board/fan.h>
 #include <board/gpio.h>
 #include <board/kbled.h>
 #include <board/lid.h>
@@ -113,8 +114,9 @@ uint8_t acpi_read(uint8_t addr) {
         case 0x26:
             // If AC adapter connected
             if (!gpio_get(&ACIN_N)) {
-                // And battery is not fully charged
-                if (battery_current != 0) {
+                // And current flows into the battery, it is negative while
+                // discharging
+                if ((int16_t)battery_current > 0) {
                     // Battery is charging
                     data |= 1 << 1;
                 }
@@ -124,6 +126,13 @@ uint8_t acpi_read(uint8_t addr) {
         ACPI_16(0x2A, battery_current);
         ACPI_16(0x2E, battery_remaining_capacity);
         ACPI_16(0x32, battery_voltage);
+        // CPU package power in mW
+        ACPI_32(0x36, peci_power);
+        // Charge profile state
+        ACPI_8(0x3A, battery_charge_state);
+        // Smoothed minutes to empty and to full, 0xFFFF if unknown
+        ACPI_16(0x3B, battery_time_to_empty);
+        ACPI_16(0x3D, battery_time_to_full);
 
         ACPI_8(0x68, acpi_ecos);
 
@@ -145,6 +154,8 @@ uint8_t acpi_read(uint8_t addr) {
         ACPI_8(0xCF, DCR1);
         ACPI_8(0xD2, F2TLRR);
         ACPI_8(0xD3, F2TMRR);
+        // Bit set for each stalled fan
+        ACPI_8(0xD4, fan_stalled);
 
 #if HAVE_LED_AIRPLANE
         // Airplane mode LED
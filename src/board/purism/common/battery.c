@@ -58,6 +58,135 @@ bool battery_set_end_threshold(uint8_t value) {
     return true;
 }
 
+// Charge profile: precharge a deeply discharged battery, then charge at
+// constant current up to the charge voltage, then taper the current with the
+// charger holding the voltage, until it falls to the termination current.
+// The charge current and voltage follow the requests of the battery.
+
+// Precharge at this fraction of the charge current, but at least
+// CHARGE_PRECHARGE_MIN mA, until the battery is CHARGE_PRECHARGE_MARGIN mV
+// above its minimum voltage
+#define CHARGE_PRECHARGE_DIV 10
+#define CHARGE_PRECHARGE_MIN 128
+#define CHARGE_PRECHARGE_MARGIN 200
+// Lowest charge voltage a battery can request, in mV
+#define CHARGE_VOLTAGE_MIN 7000
+// Constant voltage starts this close to the charge voltage, in mV
+#define CHARGE_CV_MARGIN 50
+// and goes back to constant current if the voltage falls this far below it
+#define CHARGE_CC_MARGIN 300
+// Charge current resolution of the charger in mA
+#define CHARGE_CURRENT_STEP 64
+// Charging terminates at this fraction of the charge current, for
+// CHARGE_TERM_SAMPLES samples
+#define CHARGE_TERM_DIV 20
+#define CHARGE_TERM_SAMPLES 5
+// Battery temperature range for charging, and above which the current is
+// halved, in 0.1 degrees C
+#define CHARGE_TEMP_MIN 0
+#define CHARGE_TEMP_MAX 500
+#define CHARGE_TEMP_DERATE 450
+
+uint8_t battery_charge_state = CHARGE_STATE_OFF;
+
+static void battery_charge_state_set(uint8_t state) {
+    if (state != battery_charge_state) {
+        DEBUG("CHG state %d -> %d\n", battery_charge_state, state);
+        battery_charge_state = state;
+    }
+}
+
+/**
+ * Get the charge current for the next interval, 0 to stop charging.
+ */
+static uint16_t battery_charge_profile(void) {
+    static uint16_t taper = 0;
+    static uint8_t term_samples = 0;
+    int16_t temp = (int16_t)battery_temp;
+    int16_t measured = (int16_t)battery_current;
+    uint16_t target = battery_requested_current;
+    uint16_t current;
+
+    // the charger regulates to battery_charge_voltage, a request of 0 is
+    // handled by the current request
+    if (battery_requested_voltage >= CHARGE_VOLTAGE_MIN)
+        battery_charge_voltage = battery_requested_voltage;
+
+    if (battery_charge_max_current && target > battery_charge_max_current)
+        target = battery_charge_max_current;
+
+    if ((temp < CHARGE_TEMP_MIN) || (temp >= CHARGE_TEMP_MAX) || (target == 0)) {
+        // battery asks for no charge, or is too cold or hot
+        battery_charge_state_set(CHARGE_STATE_PAUSED);
+        return 0;
+    }
+    if (temp >= CHARGE_TEMP_DERATE)
+        target /= 2;
+
+    if (measured < 0)
+        measured = 0;
+
+    switch (battery_charge_state) {
+        case CHARGE_STATE_PRECHARGE:
+        case CHARGE_STATE_CC:
+        case CHARGE_STATE_CV:
+            break;
+        default:
+            term_samples = 0;
+            if (battery_voltage < battery_min_voltage)
+                battery_charge_state_set(CHARGE_STATE_PRECHARGE);
+            else
+                battery_charge_state_set(CHARGE_STATE_CC);
+            break;
+    }
+
+    if (battery_charge_state == CHARGE_STATE_PRECHARGE) {
+        if (battery_voltage < battery_min_voltage + CHARGE_PRECHARGE_MARGIN) {
+            current = target / CHARGE_PRECHARGE_DIV;
+            if (current < CHARGE_PRECHARGE_MIN)
+                current = CHARGE_PRECHARGE_MIN;
+            return current;
+        }
+        battery_charge_state_set(CHARGE_STATE_CC);
+    }
+
+    if (battery_charge_state == CHARGE_STATE_CC) {
+        if (battery_voltage + CHARGE_CV_MARGIN < battery_charge_voltage)
+            return target;
+        battery_charge_state_set(CHARGE_STATE_CV);
+        taper = target;
+        term_samples = 0;
+    }
+
+    // constant voltage, the charger holds the voltage and the current falls
+    if (battery_voltage + CHARGE_CC_MARGIN < battery_charge_voltage) {
+        // a load pulled the voltage down, charge at constant current again
+        battery_charge_state_set(CHARGE_STATE_CC);
+        return target;
+    }
+
+    // follow the falling current one step above what the battery takes, but
+    // only while it takes less than the charger was set to. When the adapter
+    // limit held the current down, it is the limit that was measured, and the
+    // battery can take more again once the limit lifts.
+    current = (((uint16_t)measured + CHARGE_CURRENT_STEP - 1) / CHARGE_CURRENT_STEP + 1) * CHARGE_CURRENT_STEP;
+    if (current < taper && current <= battery_charge_current)
+        taper = current;
+    if (taper > target)
+        taper = target;
+
+    if ((uint16_t)measured <= target / CHARGE_TERM_DIV) {
+        if (++term_samples >= CHARGE_TERM_SAMPLES) {
+            battery_charge_state_set(CHARGE_STATE_DONE);
+            return 0;
+        }
+    } else {
+        term_samples = 0;
+    }
+
+    return taper;
+}
+
 /**
  * Configure the charger based on charging threshold values.
  */
@@ -77,6 +206,22 @@ static int battery_charger_configure(void) {
     }
 
     if (battery_present && should_charge && charger_present) {
+        uint16_t limit = board_battery_charge_limit();
+
+        battery_charge_current = battery_charge_profile();
+        // leave the system its share of the adapter
+        if (battery_charge_current > limit)
+            battery_charge_current = limit;
+        if (battery_charge_current == 0) {
+            // done, or paused until the battery is back in its temperature
+            // range
+            battery_charger_disable();
+            gpio_set(&LED_BAT_CHG, true);
+            if (battery_charge_state == CHARGE_STATE_DONE)
+                should_charge = false;
+            return 0;
+        }
+
         gpio_set(&LED_BAT_CHG, false);
         // while 'on' only light the charging LED
         if (power_state == POWER_STATE_DS3 ||
@@ -86,21 +231,6 @@ static int battery_charger_configure(void) {
             gpio_set(&LED_PWR, true);
             gpio_set(&LED_BAT_WARN, true);
         }
-        if (battery_charge < 10)
-            battery_charge_current = (battery_charge_max_current / 8);
-        else if (battery_charge < 20)
-            battery_charge_current = (battery_charge_max_current / 6);
-        else if (battery_charge < 40)
-            battery_charge_current = (battery_charge_max_current / 4);
-        else if (battery_charge < 80)
-            battery_charge_current = (battery_charge_max_current / 2);
-        else if (battery_charge < 90)
-            battery_charge_current = (battery_charge_max_current / 4);
-        else if (battery_charge < 95)
-            battery_charge_current = (battery_charge_max_current / 6);
-        else
-            battery_charge_current = (battery_charge_max_current / 8);
-
         battery_charger_enable();
         return 0;
     } else {
@@ -130,6 +260,8 @@ static int battery_charger_configure(void) {
         }
         // charging has been stopped or interrupted (e.g. charger removed) -> clear flag
         should_charge = false;
+        if (!charger_present || battery_charge_state != CHARGE_STATE_DONE)
+            battery_charge_state_set(CHARGE_STATE_OFF);
 
         return 0;
     }
@@ -150,6 +282,8 @@ uint16_t battery_manufacturing_date = 0;
 uint16_t battery_charge_voltage = 0;
 uint16_t battery_charge_current = 0;
 uint16_t battery_charge_max_current = 0;
+uint16_t battery_requested_current = 0;
+uint16_t battery_requested_voltage = 0;
 uint16_t battery_min_voltage = 0;
 
 uint16_t charger_input_current = 0x00;
@@ -158,16 +292,75 @@ uint16_t charger_min_system_voltage = 0x1600;
 // default to false, will be updated when GPIO state checked in board_battery.c
 bool battery_present = false;
 
+// Battery power is smoothed with weight 1/2^BATTERY_POWER_SHIFT per sample, so
+// runtime estimates do not jump with every change in load
+#define BATTERY_POWER_SHIFT 5
+// Below this power in mW the battery is considered idle
+#define BATTERY_POWER_IDLE 100
+
+// Smoothed battery power in mW, and whether it is charging
+uint32_t battery_power = 0;
+bool battery_power_charging = false;
+// Estimated minutes until empty and until full, BATTERY_TIME_UNKNOWN when the
+// battery is not discharging or charging
+uint16_t battery_time_to_empty = BATTERY_TIME_UNKNOWN;
+uint16_t battery_time_to_full = BATTERY_TIME_UNKNOWN;
+
+// Smoothed power scaled by 2^BATTERY_POWER_SHIFT, zero to start over
+static uint32_t battery_power_sum = 0;
+
+// Minutes to move capacity mAh at the smoothed power
+static uint16_t battery_time(uint16_t capacity) {
+    if (battery_power < BATTERY_POWER_IDLE) return BATTERY_TIME_UNKNOWN;
+
+    uint32_t energy = ((uint32_t)capacity * battery_voltage) / 1000;
+    uint32_t minutes = (energy * 60) / battery_power;
+    if (minutes >= BATTERY_TIME_UNKNOWN) return BATTERY_TIME_UNKNOWN - 1;
+    return (uint16_t)minutes;
+}
+
+static void battery_estimate(void) {
+    int16_t current = (int16_t)battery_current;
+    bool charging = current > 0;
+    uint32_t power = ((uint32_t)(charging ? current : -current) * battery_voltage) / 1000;
+
+    // Start over when the battery changes direction or has just been found
+    if (battery_power_sum == 0 || charging != battery_power_charging) {
+        battery_power_sum = power << BATTERY_POWER_SHIFT;
+        battery_power_charging = charging;
+    } else {
+        battery_power_sum += power - (battery_power_sum >> BATTERY_POWER_SHIFT);
+    }
+    battery_power = battery_power_sum >> BATTERY_POWER_SHIFT;
+
+    battery_time_to_empty = BATTERY_TIME_UNKNOWN;
+    battery_time_to_full = BATTERY_TIME_UNKNOWN;
+    if (battery_power_charging) {
+        if (battery_full_capacity > battery_remaining_capacity)
+            battery_time_to_full = battery_time(
+                battery_full_capacity - battery_remaining_capacity);
+    } else {
+        battery_time_to_empty = battery_time(battery_remaining_capacity);
+    }
+}
+
 void battery_event(void) {
     if (battery_present) {
         board_battery_update_state(); // this will update all available runtime values
         DEBUG("BAT %04x %dmV %dmA %d%%\n", battery_status, battery_voltage, battery_current, battery_charge);
+        battery_estimate();
+    } else {
+        battery_power_sum = 0;
+        battery_power = 0;
+        battery_time_to_empty = BATTERY_TIME_UNKNOWN;
+        battery_time_to_full = BATTERY_TIME_UNKNOWN;
     }
     if (battery_status & 0x9000) {
         // battery reports an error or problem
         // disable charger by all means and
         // blink warning LED
         battery_charger_disable();
+        battery_charge_state_set(CHARGE_STATE_OFF);
         gpio_set(&LED_BAT_WARN, !gpio_get(&LED_BAT_WARN));
         gpio_set(&LED_PWR, true);
     } else {
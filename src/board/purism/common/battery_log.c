@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// Keeps a history of battery readings in a ring buffer, so charging problems
+// can be looked at after the fact. Samples are numbered by a sequence number
+// that keeps counting when old samples are overwritten, which lets the host
+// read the log in chunks while new samples are being added.
+//
+// Samples are taken on a fixed schedule, so their time is not stored but
+// computed from the start of the run of samples. A run ends, dropping the
+// older samples, when logging is stopped, the interval changes, or sampling
+// falls behind by more than an interval.
+
+#include <arch/time.h>
+#include <board/battery.h>
+#include <board/battery_log.h>
+
+// Packed sample, a battery that is not present is logged as all zeros
+struct BatteryLogEntry {
+    // Voltage in 64 mV
+    uint8_t voltage;
+    // Current in 64 mA
+    int8_t current;
+    // Temperature in degrees C
+    int8_t temp;
+    // Charge state in bits 0 to 2, status bits 11 to 15 in bits 3 to 7
+    uint8_t flags;
+};
+
+#define BATTERY_LOG_STATE_MASK 0x07
+
+uint16_t battery_log_interval = BATTERY_LOG_INTERVAL;
+uint32_t battery_log_next = 0;
+
+// SRAM at 0xC00 is not mapped by the scratch ROM window and not used by the
+// host RAM windows at 0xE00
+static struct BatteryLogEntry __xdata __at(0xC00) battery_log[BATTERY_LOG_SIZE];
+static uint8_t __xdata battery_log_charge[BATTERY_LOG_SIZE];
+
+// Current run of samples, its first sequence number, time and interval
+static bool battery_log_running = false;
+static uint32_t battery_log_start = 0;
+static uint32_t battery_log_start_time = 0;
+static uint16_t battery_log_run_interval = 0;
+// Time the next sample is due
+static uint32_t battery_log_due = 0;
+
+static int8_t battery_log_clamp(int16_t value) {
+    if (value > 127) return 127;
+    if (value < -128) return -128;
+    return (int8_t)value;
+}
+
+void battery_log_event(void) {
+    if (battery_log_interval == 0) {
+        battery_log_running = false;
+        return;
+    }
+
+    uint32_t time = time_get() / 1000;
+    if (battery_log_running) {
+        if (battery_log_run_interval != battery_log_interval) {
+            battery_log_running = false;
+        } else if (time < battery_log_due) {
+            // Not due yet, unless the timer wrapped
+            if ((battery_log_due - time) <= battery_log_interval) return;
+            battery_log_running = false;
+        } else if ((time - battery_log_due) > battery_log_interval) {
+            battery_log_running = false;
+        }
+    }
+    if (!battery_log_running) {
+        battery_log_running = true;
+        battery_log_start = battery_log_next;
+        battery_log_start_time = time;
+        battery_log_run_interval = battery_log_interval;
+        battery_log_due = time;
+    }
+    battery_log_due += battery_log_interval;
+
+    uint8_t index = (uint8_t)(battery_log_next % BATTERY_LOG_SIZE);
+    struct BatteryLogEntry *entry = &battery_log[index];
+    if (battery_present) {
+        uint16_t voltage = battery_voltage >> 6;
+        entry->voltage = (voltage > 0xFF) ? 0xFF : (uint8_t)voltage;
+        entry->current = battery_log_clamp((int16_t)battery_current / 64);
+        entry->temp = battery_log_clamp((int16_t)battery_temp / 10);
+        entry->flags = ((uint8_t)(battery_status >> 8) & ~BATTERY_LOG_STATE_MASK) |
+            (battery_charge_state & BATTERY_LOG_STATE_MASK);
+        battery_log_charge[index] = (uint8_t)battery_charge;
+    } else {
+        entry->voltage = 0;
+        entry->current = 0;
+        entry->temp = 0;
+        entry->flags = 0;
+        battery_log_charge[index] = 0;
+    }
+    battery_log_next++;
+}
+
+uint32_t battery_log_first(void) {
+    uint32_t first = 0;
+    if (battery_log_next >= BATTERY_LOG_SIZE) first = battery_log_next - BATTERY_LOG_SIZE;
+    // Older runs can not be timed
+    if (first < battery_log_start) first = battery_log_start;
+    return first;
+}
+
+bool battery_log_get(uint32_t seq, struct BatteryLogSample *sample) {
+    if (seq < battery_log_first() || seq >= battery_log_next) return false;
+
+    uint8_t index = (uint8_t)(seq % BATTERY_LOG_SIZE);
+    struct BatteryLogEntry *entry = &battery_log[index];
+    sample->time = battery_log_start_time +
+        (seq - battery_log_start) * battery_log_run_interval;
+    sample->voltage = (uint16_t)entry->voltage << 6;
+    sample->current = (int16_t)entry->current * 64;
+    sample->temp = (int16_t)entry->temp * 10;
+    sample->status = (uint16_t)(entry->flags & ~BATTERY_LOG_STATE_MASK) << 8;
+    sample->charge = battery_log_charge[index];
+    sample->charge_state = entry->flags & BATTERY_LOG_STATE_MASK;
+    return true;
+}
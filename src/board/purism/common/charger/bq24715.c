@@ -3,15 +3,126 @@
 // TI BQ24715 Smart Charger
 // https://www.ti.com/lit/gpn/BQ24715
 
+#include <arch/time.h>
 #include <board/battery.h>
 #include <board/smbus.h>
 #include <common/debug.h>
+#include <common/macro.h>
 
 #include <charger/bq24715.h>
 
+// Registers are written through a shadow, so each is only written when its
+// value changes. One register is read back every CHARGER_RECONCILE_INTERVAL ms
+// and written again if the charger lost it, for example after a reset.
+#define CHARGER_RECONCILE_INTERVAL 2000
+
+// While charging, the charger stops if ChargeCurrent or ChargeVoltage are not
+// written for 44 s, so a hung EC can not leave it charging. ChargeCurrent is
+// written again every CHARGER_WATCHDOG_REFRESH ms.
+#define CHARGER_WATCHDOG_REFRESH 20000
+
+enum ChargerRegister {
+    CHARGER_OPTION0 = 0,
+    CHARGER_CURRENT = 1,
+    CHARGER_VOLTAGE = 2,
+    CHARGER_MIN_SYS_VOLTAGE = 3,
+    CHARGER_INPUT_CURRENT = 4,
+};
+
+struct ChargerShadow {
+    uint8_t command;
+    // Bits that can be written
+    uint16_t mask;
+};
+
+static const struct ChargerShadow __code CHARGER_SHADOWS[] = {
+    [CHARGER_OPTION0] = { .command = 0x12, .mask = ~SBC_SYSOVP_STAT },
+    [CHARGER_CURRENT] = { .command = 0x14, .mask = 0x1FC0 },
+    [CHARGER_VOLTAGE] = { .command = 0x15, .mask = 0x7FF0 },
+    [CHARGER_MIN_SYS_VOLTAGE] = { .command = 0x3E, .mask = 0x3F00 },
+    [CHARGER_INPUT_CURRENT] = { .command = 0x3F, .mask = 0x1FC0 },
+};
+
+static uint16_t charger_values[ARRAY_SIZE(CHARGER_SHADOWS)];
+// Bit set for each register whose value is known
+static uint8_t charger_known = 0;
 
 static bool charger_enabled = true; // charger is enable by default at POR
-static int last_current = 0;
+// Last write that reset the charger watchdog
+static uint32_t charger_watchdog_time = 0;
+
+// Write a register unless it already holds value
+static int charger_write(enum ChargerRegister reg, uint16_t value) {
+    const struct ChargerShadow * shadow = &CHARGER_SHADOWS[reg];
+    int res;
+
+    value &= shadow->mask;
+    if ((charger_known & BIT(reg)) && charger_values[reg] == value)
+        return 0;
+
+    res = smbus_write(CHARGER_ADDRESS, shadow->command, value);
+    if (res < 0) {
+        charger_known &= ~BIT(reg);
+        return res;
+    }
+
+    charger_values[reg] = value;
+    charger_known |= BIT(reg);
+    if (reg == CHARGER_CURRENT || reg == CHARGER_VOLTAGE)
+        charger_watchdog_time = time_get();
+    return 0;
+}
+
+// Read back one register at a time, and restore it if it does not match
+static void charger_reconcile(void) {
+    static uint32_t last_time = 0;
+    static uint8_t next = 0;
+    uint32_t time = time_get();
+    const struct ChargerShadow * shadow;
+    enum ChargerRegister reg;
+    uint16_t data = 0;
+    int res;
+
+    if (last_time <= time && (time - last_time) < CHARGER_RECONCILE_INTERVAL)
+        return;
+    last_time = time;
+
+    reg = next;
+    next = (next + 1) % ARRAY_SIZE(CHARGER_SHADOWS);
+    if (!(charger_known & BIT(reg)))
+        return;
+
+    shadow = &CHARGER_SHADOWS[reg];
+    res = smbus_read(CHARGER_ADDRESS, shadow->command, &data);
+    if (res < 0) {
+        DEBUG("CHG read 0x%02X failed\n", shadow->command);
+        return;
+    }
+
+    if ((data & shadow->mask) != charger_values[reg]) {
+        DEBUG("CHG 0x%02X is %04X, restoring %04X\n", shadow->command, data, charger_values[reg]);
+        charger_known &= ~BIT(reg);
+        charger_write(reg, charger_values[reg]);
+    }
+}
+
+// Reset the charger watchdog before it expires
+static void charger_watchdog(void) {
+    uint32_t time = time_get();
+
+    if (!charger_enabled)
+        return;
+    if (charger_watchdog_time <= time && (time - charger_watchdog_time) < CHARGER_WATCHDOG_REFRESH)
+        return;
+
+    charger_known &= ~BIT(CHARGER_CURRENT);
+    if (charger_write(CHARGER_CURRENT, charger_values[CHARGER_CURRENT]) < 0) {
+        DEBUG("CHG watchdog refresh failed\n");
+        // Retry on the next refresh instead of every main loop iteration,
+        // which is still inside the 44 s charger watchdog
+        charger_watchdog_time = time;
+    }
+}
 
 int battery_charger_disable(void) {
     int res = 0;
@@ -22,10 +133,9 @@ int battery_charger_disable(void) {
 
     DEBUG("CHG disable\n");
 
-    // Set charge option 0 with 175s watchdog
-    res = smbus_write(
-        CHARGER_ADDRESS,
-        0x12,
+    // Set charge option 0 with watchdog disabled
+    res = charger_write(
+        CHARGER_OPTION0,
         SBC_CHARGE_INHIBIT | SBC_LSFET_OCP_THR | SBC_PWM_FREQ_1MHZ | SBC_FIX_IOUT
     );
     if (res < 0) {
@@ -36,7 +146,6 @@ int battery_charger_disable(void) {
     DEBUG("CHG disabled\n");
 
     charger_enabled = false;
-    last_current = 0;
 
     battery_charger_debug();
 
@@ -47,71 +156,68 @@ int battery_charger_set_charge_current(int current)
 {
     int res;
 
-    // Set charge current in mA,
-    if (current == last_current)
-        return 0;
-
     // Set charge voltage in mV,
     // must be set before charge current
-    res = smbus_write(CHARGER_ADDRESS, 0x15, battery_charge_voltage & 0x7FF0);
+    res = charger_write(CHARGER_VOLTAGE, battery_charge_voltage);
     if (res < 0)
         return res;
 
-    res = smbus_write(CHARGER_ADDRESS, 0x14, current & 0x1FC0);
-    if (res < 0) {
-        return res;
-    } else {
-        last_current = current;
-        return 0;
-    }
+    // Set charge current in mA
+    return charger_write(CHARGER_CURRENT, current);
 }
 
 int battery_charger_enable(void) {
     int res = 0;
 
     if (charger_enabled) {
-        if (battery_charge_current != last_current) {
-            res = battery_charger_set_charge_current(battery_charge_current);
+        // Input current follows the adapter
+        res = charger_write(CHARGER_INPUT_CURRENT, charger_input_current);
+        if (res < 0)
             return res;
-        } else
+
+        if ((charger_known & BIT(CHARGER_CURRENT)) &&
+            (battery_charge_current & CHARGER_SHADOWS[CHARGER_CURRENT].mask) == charger_values[CHARGER_CURRENT])
             return 1;
+        return battery_charger_set_charge_current(battery_charge_current);
     }
 
     DEBUG("CHG enable @ %dmV %dmA\n", battery_charge_voltage, battery_charge_current);
 
     // first make sure charge is inhibited before changing parameters
-    res = smbus_write(
-        CHARGER_ADDRESS,
-        0x12,
+    res = charger_write(
+        CHARGER_OPTION0,
         SBC_CHARGE_INHIBIT | SBC_LSFET_OCP_THR | SBC_PWM_FREQ_1MHZ | SBC_FIX_IOUT
     );
-    // res = battery_charger_disable();
     if (res < 0)
         return res;
 
     // Set minimum system voltage
-    res = smbus_write(CHARGER_ADDRESS, 0x3E, charger_min_system_voltage & 0x3F00);
+    res = charger_write(CHARGER_MIN_SYS_VOLTAGE, charger_min_system_voltage);
     if (res < 0)
         return res;
 
     // Set input current in mA
-    res = smbus_write(CHARGER_ADDRESS, 0x3F, charger_input_current & 0x1FC0);
+    res = charger_write(CHARGER_INPUT_CURRENT, charger_input_current);
     if (res < 0)
         return res;
 
     // Set charge current in mA
-    res = battery_charger_set_charge_current(battery_charge_current & 0x1FC0);
+    res = battery_charger_set_charge_current(battery_charge_current);
     if (res < 0)
         return res;
 
-    // Set charge option 0 with watchdog disabled
-    res = smbus_write(
-        CHARGER_ADDRESS,
-        0x12,
+    // Set charge option 0 with 44s watchdog, and input current regulation so
+    // the adapter is not overloaded
+    res = charger_write(
+        CHARGER_OPTION0,
+        SBC_IDPM_EN |
         SBC_PWM_FREQ_1MHZ |
         SBC_FIX_IOUT |
-        SBC_AUDIO_FREQ_LIM
+        SBC_AUDIO_FREQ_LIM |
+        SBC_WDTMR_ADJ_44S
     );
+    if (res < 0)
+        return res;
 
     DEBUG("CHG enabled\n");
     charger_enabled = true;
@@ -124,7 +230,9 @@ bool battery_charger_is_enabled(void) {
     return charger_enabled;
 }
 
+// Dump the charger registers, only with CHARGER_DEBUG as it takes seven reads
 void battery_charger_debug(void) {
+#ifdef CHARGER_DEBUG
     uint16_t data = 0;
     int res = 0;
 
@@ -158,11 +266,11 @@ void battery_charger_debug(void) {
     commandx(DeviceID, CHARGER_ADDRESS, 0xFF);
 
     #undef command
+    #undef commandx
+#endif // CHARGER_DEBUG
 }
 
 void battery_charger_event(void) {
-    //TODO: watchdog
-    //DEBUG("CHG event\n");
-    //battery_charger_debug();
+    charger_watchdog();
+    charger_reconcile();
 }
-
@@ -3,6 +3,8 @@
 #include <board/config.h>
 
 #include <board/battery.h>
+#include <board/fan.h>
+#include <board/flash.h>
 #include <board/kbscan.h>
 #include <board/keymap.h>
 #include <common/debug.h>
@@ -22,4 +24,24 @@ void config_reset(void) {
     battery_reset();
     keymap_erase_config();
     keymap_load_default();
+    for (uint8_t i = 0; i < FAN_COUNT; i++) {
+        fan_load_default(i);
+    }
+}
+
+/**
+ * Save the settings in flags to flash. The config sector can only be erased
+ * as a whole, so settings that were saved before are written again.
+ */
+bool config_save(uint8_t flags) {
+    if (keymap_config_valid()) flags |= CONFIG_KEYMAP;
+    if (fan_config_valid()) flags |= CONFIG_FAN;
+
+    // This will erase 1024 bytes
+    flash_erase(CONFIG_ADDR);
+    if (flash_read_u16(CONFIG_ADDR) != 0xFFFF) return false;
+
+    if ((flags & CONFIG_KEYMAP) && !keymap_write_config()) return false;
+    if ((flags & CONFIG_FAN) && !fan_write_config()) return false;
+    return true;
 }
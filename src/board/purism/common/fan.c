@@ -1,42 +1,186 @@
 // SPDX-License-Identifier: GPL-3.0-only
 
+#include <arch/time.h>
+#include <board/battery.h>
+#include <board/board.h>
+#include <board/config.h>
 #include <board/fan.h>
+#include <board/flash.h>
+#include <board/peci.h>
+#include <board/power.h>
+#include <common/debug.h>
+#include <common/macro.h>
+#include <ec/pwm.h>
 
 bool fan_max = false;
+uint8_t fan_stalled = 0;
+
+#define FAN_POINT(T, D) { .temp = (T), .duty = (D) }
+
+// Default fan curve with temperature in degrees C, duty cycle in percent
+static const struct FanConfigPoint __code FAN_POINTS_DEFAULT[] = {
+#ifdef BOARD_FAN_POINTS
+    BOARD_FAN_POINTS
+#else
+    FAN_POINT(70, 40),
+    FAN_POINT(75, 50),
+    FAN_POINT(80, 60),
+    FAN_POINT(85, 65),
+    FAN_POINT(90, 65)
+#endif
+};
+
+// Fan 1 follows the curve of fan 0 unless the board gives it its own
+#ifdef BOARD_FAN1_POINTS
+static const struct FanConfigPoint __code FAN1_POINTS_DEFAULT[] = {
+    BOARD_FAN1_POINTS
+};
+#endif
+
+#ifndef BOARD_FAN_SOURCE
+    #define BOARD_FAN_SOURCE FAN_SOURCE_PECI
+#endif
+
+#ifndef BOARD_FAN1_SOURCE
+    #define BOARD_FAN1_SOURCE BOARD_FAN_SOURCE
+#endif
+
+// Fan speed is the lowest requested over HEATUP seconds
+#ifndef BOARD_HEATUP
+    #define BOARD_HEATUP 10
+#endif
+
+// Fan speed is the highest HEATUP speed over COOLDOWN seconds
+#ifndef BOARD_COOLDOWN
+    #define BOARD_COOLDOWN 10
+#endif
+
+// Longest heatup and cooldown that can be configured
+#ifndef BOARD_HEATUP_MAX
+    #define BOARD_HEATUP_MAX BOARD_HEATUP
+#endif
+
+#ifndef BOARD_COOLDOWN_MAX
+    #define BOARD_COOLDOWN_MAX BOARD_COOLDOWN
+#endif
+
+// Window of S seconds, holding S samples at one per second. Half a second less
+// absorbs timer jitter.
+#define FAN_WINDOW_PERIOD(S) (((uint16_t)(S)) * 1000 - 500)
+
+static struct FanWindowEntry FAN_HEATUP_ENTRIES[FAN_COUNT][FAN_WINDOW_SIZE(BOARD_HEATUP_MAX)];
+static struct FanWindow FAN_HEATUPS[FAN_COUNT];
+
+static struct FanWindowEntry FAN_COOLDOWN_ENTRIES[FAN_COUNT][FAN_WINDOW_SIZE(BOARD_COOLDOWN_MAX)];
+static struct FanWindow FAN_COOLDOWNS[FAN_COUNT];
+
+// Duty for each whole degree from the first point, computed from the points
+#ifndef BOARD_FAN_DUTIES
+    #define BOARD_FAN_DUTIES 64
+#endif
+
+static uint8_t FAN_DUTIES[FAN_COUNT][BOARD_FAN_DUTIES];
+
+// Fan N drives DCRN, each with its own curve, filters and temperature source
+struct Fan FANS[FAN_COUNT];
+
+// Settings of fan N follow its signature at CONFIG_FAN_ADDR(N). The signature
+// is the size of the settings.
+#define FAN_CONFIG_SIGNATURE ((uint16_t)sizeof(struct FanConfig))
+
+// Tachometer counts per minute: EC clock / 128 * 60, at 2 pulses per revolution
+#define FAN_TACH_FREQ 2156250UL
+
+// A fan driven at FAN_STALL_DUTY or more that does not spin for
+// FAN_STALL_TIME ms is stalled
+#define FAN_STALL_DUTY PWM_DUTY(20)
+#define FAN_STALL_TIME 5000
+
+// Integral term limit, in 1/256 duty
+#define FAN_INTEGRAL_MAX (64 << 8)
+
+struct FanControl {
+    // Integral term, in 1/256 duty
+    int16_t integral;
+    uint32_t time;
+    uint32_t stall_time;
+    bool stalling;
+};
+
+static struct FanControl fan_controls[FAN_COUNT] = { 0 };
+
+#ifdef BOARD_FAN_LOOKAHEAD
+// With BOARD_FAN_LOOKAHEAD, fans follow the temperature their source is
+// heading for in that many seconds, so they ramp ahead of a heat spike. Only
+// rising temperatures are projected, so steady-state duties do not change.
+
+// Highest projected rise in degrees C
+#ifndef BOARD_FAN_LOOKAHEAD_MAX
+    #define BOARD_FAN_LOOKAHEAD_MAX 10
+#endif
+
+// Fans on the CPU only project while its package draws this many W, when the
+// package power is known, so temperature blips at idle do not spin them up
+#ifndef BOARD_FAN_LOOKAHEAD_POWER
+    #define BOARD_FAN_LOOKAHEAD_POWER 0
+#endif
+
+// Samples further apart than this many ms start a new trend
+#define FAN_TREND_GAP 5000
+
+struct FanTrend {
+    int16_t temp;
+    uint16_t time;
+    // Smoothed slope in 1/64 degrees C per second
+    int16_t slope;
+    bool valid;
+};
+
+static struct FanTrend fan_trends[FAN_COUNT] = { 0 };
+#endif // BOARD_FAN_LOOKAHEAD
 
 void fan_reset(void) {
     // Do not manually set fans to maximum speed
     fan_max = false;
 }
 
+// Get point i of the curve in fan temperature and PWM duty units. Only the
+// settings keep the points, the duty table is used once they are applied.
+static void fan_point(const struct Fan * fan, uint8_t i, struct FanPoint * point) __reentrant {
+    point->temp = FAN_TEMP(fan->config.points[i].temp);
+    point->duty = PWM_DUTY(fan->config.points[i].duty);
+}
+
 // Get duty cycle based on temperature, adapted from
 // https://github.com/pop-os/system76-power/blob/master/src/fan.rs
-uint8_t fan_duty(const struct Fan * fan, int16_t temp) __reentrant {
+static uint8_t fan_duty_search(const struct Fan * fan, int16_t temp) __reentrant {
+    struct FanPoint cur;
+    struct FanPoint prev;
     for (int i = 0; i < fan->points_size; i++) {
-        const struct FanPoint * cur = &fan->points[i];
+        fan_point(fan, i, &cur);
 
         // If exactly the current temp, return the current duty
-        if (temp == cur->temp) {
-            return cur->duty;
-        } else if (temp < cur->temp) {
+        if (temp == cur.temp) {
+            return cur.duty;
+        } else if (temp < cur.temp) {
             // If lower than first temp, return 0%
             if (i == 0) {
                 return PWM_DUTY(0);
             } else {
-                const struct FanPoint * prev = &fan->points[i - 1];
+                fan_point(fan, i - 1, &prev);
 
                 if (fan->interpolate) {
                     // If in between current temp and previous temp, interpolate
-                    if (temp > prev->temp) {
-                        int16_t dtemp = (cur->temp - prev->temp);
-                        int16_t dduty = ((int16_t)cur->duty) - ((int16_t)prev->duty);
+                    if (temp > prev.temp) {
+                        int16_t dtemp = (cur.temp - prev.temp);
+                        int16_t dduty = ((int16_t)cur.duty) - ((int16_t)prev.duty);
                         return (uint8_t)(
-                            ((int16_t)prev->duty) +
-                            ((temp - prev->temp) * dduty) / dtemp
+                            ((int16_t)prev.duty) +
+                            ((temp - prev.temp) * dduty) / dtemp
                         );
                     }
                 } else {
-                    return prev->duty;
+                    return prev.duty;
                 }
             }
         }
@@ -46,34 +190,455 @@ uint8_t fan_duty(const struct Fan * fan, int16_t temp) __reentrant {
     return PWM_DUTY(100);
 }
 
-uint8_t fan_heatup(const struct Fan * fan, uint8_t duty) __reentrant {
-    uint8_t lowest = duty;
+// Fill the duty table with the duty of each whole degree from the first point,
+// so fan_duty does not have to search the curve or interpolate
+static void fan_duty_init(const struct Fan * fan) __reentrant {
+    int16_t first = FAN_TEMP(fan->config.points[0].temp);
+    int16_t last = FAN_TEMP(fan->config.points[fan->points_size - 1].temp);
+    if (((last - first) >> FAN_DEGREE_SHIFT) >= fan->duties_size) {
+        ERROR("Fan curve does not fit in %d degrees\n", fan->duties_size);
+    }
 
-    int i;
-    for (i = 0; (i + 1) < fan->heatup_size; i++) {
-        uint8_t value = fan->heatup[i + 1];
-        if (value < lowest) {
-            lowest = value;
+    for (uint8_t i = 0; i < fan->duties_size; i++) {
+        int16_t temp = first + (((int16_t)i) << FAN_DEGREE_SHIFT);
+        if (temp > last) {
+            temp = last;
         }
-        fan->heatup[i] = value;
+        fan->duties[i] = fan_duty_search(fan, temp);
+    }
+}
+
+uint8_t fan_duty(const struct Fan * fan, int16_t temp) __reentrant {
+    int16_t first = FAN_TEMP(fan->config.points[0].temp);
+
+    // If lower than first temp, return 0%
+    if (temp < first) {
+        return PWM_DUTY(0);
+    }
+
+    // If higher than last temp, return 100%
+    if (temp > FAN_TEMP(fan->config.points[fan->points_size - 1].temp)) {
+        return PWM_DUTY(100);
+    }
+
+    uint16_t i = ((uint16_t)(temp - first)) >> FAN_DEGREE_SHIFT;
+    if (i >= fan->duties_size) {
+        i = fan->duties_size - 1;
+    }
+    return fan->duties[i];
+}
+
+// Add a duty to the window, returning the lowest or highest in the window
+static uint8_t fan_window(struct FanWindow * window, uint8_t duty, bool highest) __reentrant {
+    struct FanWindowEntry * entries = window->entries;
+    uint16_t time = time16_get();
+
+    // Drop the oldest entries once they leave the window
+    while (window->len &&
+        ((uint16_t)(time - entries[window->head].time) >= window->period)) {
+        window->head = (window->head + 1) % window->size;
+        window->len--;
+    }
+
+    // Drop newer entries that can no longer be the lowest or highest
+    while (window->len) {
+        uint8_t value = entries[(window->head + window->len - 1) % window->size].value;
+        if (highest ? (value > duty) : (value < duty)) {
+            break;
+        }
+        window->len--;
+    }
+
+    // If still full, merge the two entries after the head into one with the
+    // higher duty and the later time. The lowest or highest at the head is
+    // kept, and the fan only errs toward running faster.
+    if (window->len >= window->size) {
+        struct FanWindowEntry * first = &entries[(window->head + 1) % window->size];
+        struct FanWindowEntry * second = &entries[(window->head + 2) % window->size];
+        if (first->value > second->value) {
+            second->value = first->value;
+        }
+        *first = entries[window->head];
+        window->head = (window->head + 1) % window->size;
+        window->len--;
+    }
+
+    struct FanWindowEntry * entry = &entries[(window->head + window->len) % window->size];
+    entry->value = duty;
+    entry->time = time;
+    window->len++;
+
+    return entries[window->head].value;
+}
+
+// Start with a window of zero duties, as if the fan was off
+static void fan_window_reset(struct FanWindow * window) __reentrant {
+    window->head = 0;
+    window->len = 1;
+    window->entries[0].value = 0;
+    window->entries[0].time = time16_get();
+}
+
+void fan_init(void) {
+    for (uint8_t i = 0; i < FAN_COUNT; i++) {
+        struct Fan * fan = &FANS[i];
+
+        fan->duties = FAN_DUTIES[i];
+        fan->duties_size = ARRAY_SIZE(FAN_DUTIES[i]);
+
+        fan->heatup = &FAN_HEATUPS[i];
+        fan->heatup->entries = FAN_HEATUP_ENTRIES[i];
+        fan->heatup->size = ARRAY_SIZE(FAN_HEATUP_ENTRIES[i]);
+
+        fan->cooldown = &FAN_COOLDOWNS[i];
+        fan->cooldown->entries = FAN_COOLDOWN_ENTRIES[i];
+        fan->cooldown->size = ARRAY_SIZE(FAN_COOLDOWN_ENTRIES[i]);
+
+        if (!fan_load_config(i)) {
+            fan_load_default(i);
+        }
+    }
+}
+
+// Check settings before they are applied, so the duty table and windows stay
+// valid
+static bool fan_config_check(const struct FanConfig * config) {
+    if (config->points_size == 0 || config->points_size > FAN_POINTS_MAX) return false;
+    if (config->heatup == 0 || config->heatup > BOARD_HEATUP_MAX) return false;
+    if (config->cooldown == 0 || config->cooldown > BOARD_COOLDOWN_MAX) return false;
+
+    switch (config->source) {
+        case FAN_SOURCE_PECI:
+        case FAN_SOURCE_BATTERY:
+#if HAVE_FAN_THERMISTOR
+        case FAN_SOURCE_THERMISTOR:
+#endif // HAVE_FAN_THERMISTOR
+            break;
+        default:
+            return false;
+    }
+
+    for (uint8_t i = 0; i < config->points_size; i++) {
+        const struct FanConfigPoint * point = &config->points[i];
+        if (point->duty > 100) return false;
+        // Temperatures must rise from point to point
+        if (i > 0 && point->temp <= config->points[i - 1].temp) return false;
+    }
+
+    // The curve must fit in the duty table
+    uint8_t span = config->points[config->points_size - 1].temp - config->points[0].temp;
+    return span < BOARD_FAN_DUTIES;
+}
+
+void fan_config_get(uint8_t index, struct FanConfig * config) {
+    *config = FANS[index].config;
+}
+
+bool fan_config_set(uint8_t index, const struct FanConfig * config) {
+    if (index >= FAN_COUNT || !fan_config_check(config)) return false;
+
+    struct Fan * fan = &FANS[index];
+    fan->config = *config;
+
+    fan->points_size = config->points_size;
+    fan->interpolate = config->interpolate != 0;
+    fan->source = config->source;
+    fan->heatup->period = FAN_WINDOW_PERIOD(config->heatup);
+    fan->cooldown->period = FAN_WINDOW_PERIOD(config->cooldown);
+
+    fan_duty_init(fan);
+    fan_window_reset(fan->heatup);
+    fan_window_reset(fan->cooldown);
+    return true;
+}
+
+void fan_load_default(uint8_t index) {
+    const struct FanConfigPoint * points = FAN_POINTS_DEFAULT;
+    uint8_t points_size = ARRAY_SIZE(FAN_POINTS_DEFAULT);
+    struct FanConfig config = {
+        .heatup = BOARD_HEATUP,
+        .cooldown = BOARD_COOLDOWN,
+        .interpolate = 0,
+        .source = BOARD_FAN_SOURCE,
+    };
+
+    if (index == 1) {
+#ifdef BOARD_FAN1_POINTS
+        points = FAN1_POINTS_DEFAULT;
+        points_size = ARRAY_SIZE(FAN1_POINTS_DEFAULT);
+#endif
+        config.source = BOARD_FAN1_SOURCE;
+    }
+
+    config.points_size = points_size;
+    for (uint8_t i = 0; i < points_size && i < FAN_POINTS_MAX; i++) {
+        config.points[i] = points[i];
+    }
+
+    FANS[index].saved = false;
+    if (!fan_config_set(index, &config)) {
+        ERROR("Default fan %d curve is invalid\n", index);
+    }
+}
+
+// True if the settings of any fan are saved
+bool fan_config_valid(void) {
+    for (uint8_t i = 0; i < FAN_COUNT; i++) {
+        if (flash_read_u16(CONFIG_FAN_ADDR(i)) == FAN_CONFIG_SIGNATURE) return true;
+    }
+    return false;
+}
+
+bool fan_load_config(uint8_t index) {
+    // Check signature
+    if (flash_read_u16(CONFIG_FAN_ADDR(index)) != FAN_CONFIG_SIGNATURE) return false;
+
+    // Apply the settings if they are still valid for this firmware
+    struct FanConfig config;
+    flash_read(CONFIG_FAN_ADDR(index) + sizeof(FAN_CONFIG_SIGNATURE), (uint8_t *)&config, sizeof(config));
+    if (!fan_config_set(index, &config)) return false;
+
+    FANS[index].saved = true;
+    return true;
+}
+
+// Write the settings of each saved fan to erased flash
+bool fan_write_config(void) {
+    for (uint8_t i = 0; i < FAN_COUNT; i++) {
+        struct Fan * fan = &FANS[i];
+        if (!fan->saved) continue;
+
+        // Write the settings, then their size as a signature
+        flash_write(CONFIG_FAN_ADDR(i) + sizeof(FAN_CONFIG_SIGNATURE), (uint8_t *)&fan->config, sizeof(fan->config));
+        flash_write_u16(CONFIG_FAN_ADDR(i), FAN_CONFIG_SIGNATURE);
+
+        // Verify signature is valid
+        if (flash_read_u16(CONFIG_FAN_ADDR(i)) != FAN_CONFIG_SIGNATURE) return false;
     }
-    fan->heatup[i] = duty;
+    return true;
+}
+
+bool fan_save_config(uint8_t index) {
+    FANS[index].saved = true;
+    return config_save(CONFIG_FAN);
+}
 
-    return lowest;
+// Lowest duty over the heatup period, so short spikes do not raise the fan
+uint8_t fan_heatup(const struct Fan * fan, uint8_t duty) __reentrant {
+    return fan_window(fan->heatup, duty, false);
 }
 
+// Highest duty over the cooldown period, so the fan does not slow down quickly
 uint8_t fan_cooldown(const struct Fan * fan, uint8_t duty) __reentrant {
-    uint8_t highest = duty;
+    return fan_window(fan->cooldown, duty, true);
+}
+
+uint16_t fan_rpm(uint8_t index) {
+    uint16_t count;
+    switch (index) {
+        case 0:
+            count = (((uint16_t)F1TMRR) << 8) | (uint16_t)F1TLRR;
+            break;
+        case 1:
+            count = (((uint16_t)F2TMRR) << 8) | (uint16_t)F2TLRR;
+            break;
+        default:
+            return 0;
+    }
 
-    int i;
-    for (i = 0; (i + 1) < fan->cooldown_size; i++) {
-        uint8_t value = fan->cooldown[i + 1];
-        if (value > highest) {
-            highest = value;
+    // No pulses counted
+    if (count == 0 || count == 0xFFFF) return 0;
+
+    return (uint16_t)(FAN_TACH_FREQ / count);
+}
+
+// Track whether a fan spins at the duty it is driven with
+static void fan_stall_check(uint8_t index, uint8_t duty, uint16_t rpm, uint32_t time) {
+    struct FanControl * control = &fan_controls[index];
+
+    if (rpm) {
+        control->stalling = false;
+        if (fan_stalled & BIT(index)) {
+            INFO("Fan %d spinning again\n", index);
+            fan_stalled &= ~BIT(index);
+        }
+    } else if (duty >= FAN_STALL_DUTY) {
+        if (!control->stalling) {
+            control->stalling = true;
+            control->stall_time = time;
+        } else if (
+            !(fan_stalled & BIT(index)) &&
+            (time - control->stall_time) >= FAN_STALL_TIME
+        ) {
+            ERROR("Fan %d stalled\n", index);
+            fan_stalled |= BIT(index);
         }
-        fan->cooldown[i] = value;
+    } else {
+        control->stalling = false;
     }
-    fan->cooldown[i] = duty;
+}
+
+// Get the PWM duty for a fan from a duty requested by the fan curve. With
+// BOARD_FAN_MAX_RPM, the requested duty is a fraction of that speed, and a PI
+// loop on the tachometer corrects the duty until the fan reaches it.
+uint8_t fan_control(uint8_t index, uint8_t duty) {
+    if (index >= ARRAY_SIZE(fan_controls)) return duty;
+
+    struct FanControl * control = &fan_controls[index];
+    uint32_t time = time_get();
+    uint16_t rpm = fan_rpm(index);
+
+    fan_stall_check(index, duty, rpm, time);
+
+#ifdef BOARD_FAN_MAX_RPM
+    uint32_t dt = time - control->time;
+    control->time = time;
+    // Limit integration after long pauses
+    if (dt > 2000) dt = 2000;
+
+    // Open loop when off, at full speed, or when the tachometer is not
+    // usable
+    if (duty == PWM_DUTY(0) || duty == PWM_DUTY(100) || (fan_stalled & BIT(index))) {
+        control->integral = 0;
+        return duty;
+    }
+
+    // Speed error scaled to duty, the curve duty is the feedforward term
+    uint16_t target = (uint16_t)(((uint32_t)duty * BOARD_FAN_MAX_RPM) / 255);
+    int16_t error = (int16_t)((((int32_t)target - (int32_t)rpm) * 255) / BOARD_FAN_MAX_RPM);
+
+    // Ki = 0.25 per second, in 1/256 duty: error * dt * 256 / 4000
+    int32_t integral = (int32_t)control->integral + ((int32_t)error * (int32_t)dt * 8) / 125;
+    if (integral > FAN_INTEGRAL_MAX) integral = FAN_INTEGRAL_MAX;
+    if (integral < -FAN_INTEGRAL_MAX) integral = -FAN_INTEGRAL_MAX;
+    control->integral = (int16_t)integral;
+
+    // Kp = 0.5
+    int16_t output = (int16_t)duty + error / 2 + (control->integral >> 8);
+    if (output < 0) output = 0;
+    if (output > 255) output = 255;
+    return (uint8_t)output;
+#else // BOARD_FAN_MAX_RPM
+    return duty;
+#endif // BOARD_FAN_MAX_RPM
+}
+
+uint8_t fan_pwm_get(uint8_t index) {
+    switch (index) {
+        case 0:
+            return DCR0;
+        case 1:
+            return DCR1;
+        default:
+            return 0;
+    }
+}
+
+void fan_pwm_set(uint8_t index, uint8_t duty) {
+    switch (index) {
+        case 0:
+            DCR0 = duty;
+            break;
+        case 1:
+            DCR1 = duty;
+            break;
+    }
+}
+
+static void fan_update(uint8_t index, uint8_t duty) {
+    struct Fan * fan = &FANS[index];
+
+    if (fan_max) {
+        // Override duty if fans are manually set to maximum
+        duty = PWM_DUTY(100);
+    } else {
+        // Apply heatup and cooldown filters to duty
+        duty = fan_heatup(fan, duty);
+        duty = fan_cooldown(fan, duty);
+    }
+
+    duty = fan_control(index, duty);
+    if (duty != fan_pwm_get(index)) {
+        fan_pwm_set(index, duty);
+    }
+}
+
+#ifdef BOARD_FAN_LOOKAHEAD
+// Get the temperature a fan follows from a new temperature of its source
+static int16_t fan_lookahead(uint8_t index, int16_t temp) {
+    struct FanTrend * trend = &fan_trends[index];
+    uint16_t time = time16_get();
+
+    // No trend while the source is off
+    if (temp <= 0) {
+        trend->valid = false;
+        return temp;
+    }
+
+    uint16_t dt = time - trend->time;
+    if (!trend->valid || dt >= FAN_TREND_GAP) {
+        trend->temp = temp;
+        trend->time = time;
+        trend->slope = 0;
+        trend->valid = true;
+        return temp;
+    }
+    if (dt == 0) dt = 1;
+
+    // Smooth the slope of the last two samples, with a weight of 1/4
+    int32_t slope = (((int32_t)(temp - trend->temp)) * 1000) / dt;
+    if (slope > INT16_MAX) slope = INT16_MAX;
+    if (slope < INT16_MIN) slope = INT16_MIN;
+    trend->slope += (int16_t)((slope - trend->slope) / 4);
+    trend->temp = temp;
+    trend->time = time;
+
+    if (trend->slope <= 0) return temp;
+
+    if (FANS[index].source == FAN_SOURCE_PECI &&
+        peci_energy_unit != PECI_ENERGY_UNIT_NONE &&
+        peci_power < ((uint32_t)BOARD_FAN_LOOKAHEAD_POWER) * 1000) {
+        return temp;
+    }
+
+    int32_t rise = ((int32_t)trend->slope) * BOARD_FAN_LOOKAHEAD;
+    if (rise > FAN_TEMP(BOARD_FAN_LOOKAHEAD_MAX)) rise = FAN_TEMP(BOARD_FAN_LOOKAHEAD_MAX);
+    return temp + (int16_t)rise;
+}
+#endif // BOARD_FAN_LOOKAHEAD
+
+// Update the fans that use source with its new temperature
+void fan_source_event(uint8_t source, int16_t temp) {
+    for (uint8_t i = 0; i < FAN_COUNT; i++) {
+        struct Fan * fan = &FANS[i];
+        if (fan->source != source) continue;
+
+        if (temp == FAN_TEMP_INVALID) {
+#ifdef BOARD_FAN_LOOKAHEAD
+            fan_trends[i].valid = false;
+#endif // BOARD_FAN_LOOKAHEAD
+            // Default to 50% if there is an error
+            fan_update(i, PWM_DUTY(50));
+        } else {
+#ifdef BOARD_FAN_LOOKAHEAD
+            fan_update(i, fan_duty(fan, fan_lookahead(i, temp)));
+#else // BOARD_FAN_LOOKAHEAD
+            fan_update(i, fan_duty(fan, temp));
+#endif // BOARD_FAN_LOOKAHEAD
+        }
+    }
+}
+
+// Update the fans that use sources without their own schedule. Like the CPU
+// fans, they are off when the system is.
+void fan_1s_event(void) {
+    bool on = power_state == POWER_STATE_S0;
+
+    // Battery temperature is in 0.1 degrees C
+    int16_t temp = (int16_t)(((int32_t)(int16_t)battery_temp * FAN_TEMP(1)) / 10);
+    fan_source_event(FAN_SOURCE_BATTERY, on ? temp : 0);
 
-    return highest;
+#if HAVE_FAN_THERMISTOR
+    fan_source_event(FAN_SOURCE_THERMISTOR, on ? board_fan_thermistor() : 0);
+#endif // HAVE_FAN_THERMISTOR
 }
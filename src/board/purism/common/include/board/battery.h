@@ -26,6 +26,11 @@
 #define BATTERY_FULLY_CHARGED             (1U << 5)
 #define BATTERY_FULLY_DISCHARGED          (1U << 4)
 
+/* SBS string blocks */
+#define BATTERY_MANUFACTURER_NAME         0x20
+#define BATTERY_DEVICE_NAME               0x21
+#define BATTERY_DEVICE_CHEMISTRY          0x22
+
 #define BATTERY_OK                        (0x0000)
 #define BATTERY_BUSY                      (0x0001)
 #define BATTERY_RESERVED_COMMAND          (0x0002)
@@ -37,6 +42,7 @@
 
 extern uint16_t battery_temp;
 extern uint16_t battery_voltage;
+// Current in mA, two's complement, negative when discharging
 extern uint16_t battery_current;
 extern uint16_t battery_charge;
 extern uint16_t battery_remaining_capacity;
@@ -47,12 +53,41 @@ extern uint16_t battery_design_voltage;
 extern uint16_t battery_charge_voltage;
 extern uint16_t battery_charge_current;
 extern uint16_t battery_charge_max_current;
+// ChargingCurrent and ChargingVoltage requested by the battery, in mA and mV
+extern uint16_t battery_requested_current;
+extern uint16_t battery_requested_voltage;
 extern uint16_t battery_min_voltage;
 extern uint16_t battery_cycle_count;
 extern uint16_t battery_manufacturing_date;
 
 extern bool battery_present;
 
+enum ChargeState {
+    CHARGE_STATE_OFF = 0,
+    // Low current until a deeply discharged battery recovers
+    CHARGE_STATE_PRECHARGE = 1,
+    // Constant current
+    CHARGE_STATE_CC = 2,
+    // Constant voltage, current tapers off
+    CHARGE_STATE_CV = 3,
+    // Charge terminated
+    CHARGE_STATE_DONE = 4,
+    // Battery asks for no charge, or is outside its temperature range
+    CHARGE_STATE_PAUSED = 5,
+};
+
+// State of the charge profile, from enum ChargeState
+extern uint8_t battery_charge_state;
+
+// Smoothed battery power in mW, and whether it is charging
+extern uint32_t battery_power;
+extern bool battery_power_charging;
+
+// Estimated minutes until the battery is empty or full
+#define BATTERY_TIME_UNKNOWN 0xFFFF
+extern uint16_t battery_time_to_empty;
+extern uint16_t battery_time_to_full;
+
 extern uint16_t charger_input_current;
 extern uint16_t charger_min_system_voltage;
 
@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef _BOARD_BATTERY_LOG_H
+#define _BOARD_BATTERY_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of samples kept, the oldest is overwritten when the log is full. This
+// is an hour at the default interval. Samples are packed into the 512 bytes of
+// SRAM at 0xC00, outside the xram used by the linker, so this can not grow.
+#define BATTERY_LOG_SIZE 128
+
+// Default seconds between samples
+#ifndef BATTERY_LOG_INTERVAL
+    #define BATTERY_LOG_INTERVAL 30
+#endif
+
+// A sample as read back. It is stored packed, so voltage, current and
+// temperature are rounded, and only the SBS alarms in bits 11 to 15 of the
+// status are kept.
+struct BatteryLogSample {
+    // Seconds since the EC started
+    uint32_t time;
+    // Voltage in mV, in steps of 64 mV
+    uint16_t voltage;
+    // Current in mA, in steps of 64 mA, negative when discharging, for
+    // batteries with and without a gas gauge
+    int16_t current;
+    // Temperature in 0.1 degrees C, in whole degrees
+    int16_t temp;
+    // SBS battery status
+    uint16_t status;
+    // Relative state of charge in percent
+    uint8_t charge;
+    // State of the charge profile, from enum ChargeState
+    uint8_t charge_state;
+};
+
+// Seconds between samples, 0 stops logging
+extern uint16_t battery_log_interval;
+// Sequence number of the next sample, counts every sample ever logged
+extern uint32_t battery_log_next;
+
+void battery_log_event(void);
+// Sequence number of the oldest sample still in the log
+uint32_t battery_log_first(void);
+// Copy out a sample by sequence number, false if it is no longer in the log
+bool battery_log_get(uint32_t seq, struct BatteryLogSample *sample);
+
+#endif // _BOARD_BATTERY_LOG_H
@@ -4,6 +4,7 @@
 #define _BOARD_BOARD_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 void board_init(void);
 void board_event(void);
@@ -14,18 +15,40 @@ void board_battery_init(void);
 
 // voltage in mV
 uint16_t board_battery_get_voltage(void);
-// current in mA
+// current in mA, negative when discharging as with SBS Current()
 uint16_t board_battery_get_current(void);
 // charge in % (0 to 100)
 uint16_t board_battery_get_charge(void);
 
 void board_battery_update_state(void);
+// Read an SBS string block, such as BATTERY_MANUFACTURER_NAME, into a NUL
+// terminated string, returns its length
+int board_battery_get_string(uint8_t command, char * str, int size);
+// called every main loop cycle
+void board_battery_event(void);
+void board_battery_on_ac(bool ac);
+// Highest charge current in mA that does not overload the adapter
+uint16_t board_battery_charge_limit(void);
+// Rating of the adapter in W, after any derating
+uint8_t board_adapter_watts(void);
+
+#if HAVE_FAN_THERMISTOR
+// Thermistor temperature for FAN_SOURCE_THERMISTOR, in 1/64 degrees C
+int16_t board_fan_thermistor(void);
+#endif // HAVE_FAN_THERMISTOR
 
 
 // persistent settings stored in BRAM bank#1 @ 0x80..0xbf
 #define BRAM_OFFSET 0x80
 #define BRAM_CHARGE_START_THRES         (BRAM_OFFSET + 0)
 #define BRAM_CHARGE_END_THRES           (BRAM_OFFSET + 1)
+// coulomb counter of batteries without gas gauge, charge and full capacity
+// in mAh
+#define BRAM_COULOMB_CHARGE_L           (BRAM_OFFSET + 2)
+#define BRAM_COULOMB_CHARGE_H           (BRAM_OFFSET + 3)
+#define BRAM_COULOMB_FULL_L             (BRAM_OFFSET + 4)
+#define BRAM_COULOMB_FULL_H             (BRAM_OFFSET + 5)
+#define BRAM_COULOMB_FLAGS              (BRAM_OFFSET + 6)
 
 bool bram_init(void);
 bool bram_set_value(uint8_t offset, uint8_t value);
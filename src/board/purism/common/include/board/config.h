@@ -4,8 +4,20 @@
 #define _BOARD_CONFIG_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+// Config is in the last sector of flash, with the keymap at the start
+#define CONFIG_ADDR 0x1FC00
+// Settings of each fan follow the keymap
+#define CONFIG_FAN_ADDR(I) (CONFIG_ADDR + 0x300 + ((uint16_t)(I)) * 0x40)
+
+enum ConfigFlag {
+    CONFIG_KEYMAP = (1 << 0),
+    CONFIG_FAN = (1 << 1),
+};
 
 bool config_should_reset(void);
 void config_reset(void);
+bool config_save(uint8_t flags);
 
 #endif // _BOARD_CONFIG_H
@@ -13,22 +13,113 @@ struct FanPoint {
     uint8_t duty;
 };
 
+// Fan temperatures are in 1/64 degrees C, as reported by PECI. The duty table
+// has one entry per whole degree from the first point.
+#define FAN_DEGREE_SHIFT 6
+#define FAN_TEMP(X) (((int16_t)(X)) << FAN_DEGREE_SHIFT)
+// Temperature of a source that could not be read
+#define FAN_TEMP_INVALID ((int16_t)0x8000)
+
+// Fans driven by DCR0 and up
+#ifndef BOARD_FANS
+    #define BOARD_FANS 1
+#endif
+#define FAN_COUNT BOARD_FANS
+
+enum FanSource {
+    // CPU temperature from PECI
+    FAN_SOURCE_PECI = 0,
+    // Battery temperature from the gas gauge
+    FAN_SOURCE_BATTERY = 1,
+    // Board thermistor, if HAVE_FAN_THERMISTOR
+    FAN_SOURCE_THERMISTOR = 2,
+};
+
+// Most points in a fan curve
+#define FAN_POINTS_MAX 16
+
+// Fan duties are updated about once a second, and every FAN_INTERVAL_MIN ms
+// while the CPU heats up quickly. The heatup and cooldown windows have an entry
+// for each second of their length plus one for jitter, and merge entries when
+// samples come faster, instead of taking xram for every FAN_INTERVAL_MIN ms.
+#define FAN_INTERVAL_MIN 250
+#define FAN_WINDOW_SIZE(S) ((S) + 2)
+
+struct FanConfigPoint {
+    // Temperature in degrees C
+    uint8_t temp;
+    // Duty in percent
+    uint8_t duty;
+};
+
+// Fan settings that can be changed at runtime, as saved in flash and sent
+// over SMFI
+struct FanConfig {
+    // Heatup and cooldown lengths in seconds
+    uint8_t heatup;
+    uint8_t cooldown;
+    uint8_t interpolate;
+    // Temperature source, from enum FanSource
+    uint8_t source;
+    uint8_t points_size;
+    struct FanConfigPoint points[FAN_POINTS_MAX];
+};
+
+struct FanWindowEntry {
+    uint8_t value;
+    uint16_t time;
+};
+
+// Minimum or maximum of the duties of the last period ms, kept as a monotonic
+// deque in a ring buffer so each update is amortized O(1). The ring needs at
+// least 3 entries, and should have one for every sample in the period, or
+// entries after the head are merged.
+struct FanWindow {
+    struct FanWindowEntry * entries;
+    uint8_t size;
+    uint16_t period;
+    uint8_t head;
+    uint8_t len;
+};
+
 struct Fan {
-    const struct FanPoint * points;
     uint8_t points_size;
-    uint8_t * heatup;
-    uint8_t heatup_size;
-    uint8_t * cooldown;
-    uint8_t cooldown_size;
+    uint8_t * duties;
+    uint8_t duties_size;
+    struct FanWindow * heatup;
+    struct FanWindow * cooldown;
     bool interpolate;
+    uint8_t source;
+    // Settings the fan was last configured with
+    struct FanConfig config;
+    // Settings are saved in flash
+    bool saved;
 };
 
 extern bool fan_max;
+// Bit set for each fan that is driven but not spinning
+extern uint8_t fan_stalled;
+
+extern struct Fan FANS[FAN_COUNT];
 
 void fan_reset(void);
 
+void fan_init(void);
+void fan_load_default(uint8_t index);
+bool fan_load_config(uint8_t index);
+bool fan_save_config(uint8_t index);
+bool fan_config_valid(void);
+bool fan_write_config(void);
+void fan_config_get(uint8_t index, struct FanConfig * config);
+bool fan_config_set(uint8_t index, const struct FanConfig * config);
 uint8_t fan_duty(const struct Fan * fan, int16_t temp) __reentrant;
 uint8_t fan_heatup(const struct Fan * fan, uint8_t duty) __reentrant;
 uint8_t fan_cooldown(const struct Fan * fan, uint8_t duty) __reentrant;
+uint16_t fan_rpm(uint8_t index);
+uint8_t fan_control(uint8_t index, uint8_t duty);
+uint8_t fan_pwm_get(uint8_t index);
+void fan_pwm_set(uint8_t index, uint8_t duty);
+void fan_source_event(uint8_t source, int16_t temp);
+void fan_1s_event(void);
 
 #endif // _BOARD_FAN_H
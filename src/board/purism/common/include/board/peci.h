@@ -3,16 +3,55 @@
 #ifndef _BOARD_PECI_H
 #define _BOARD_PECI_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include <ec/peci.h>
 
+enum PeciCommand {
+    PECI_CMD_GET_TEMP = 0x01,
+    PECI_CMD_RD_PKG_CONFIG = 0xA1,
+    PECI_CMD_WR_PKG_CONFIG = 0xA5,
+};
+
+// Result of a request that did not finish in time
+#define PECI_ERR_TIMEOUT (-0x2000)
+
+struct PeciRequest;
+typedef void (*peci_callback_t)(struct PeciRequest * request);
+
+// Owned by the caller and must stay valid until the callback runs
+struct PeciRequest {
+    enum PeciCommand command;
+    uint8_t index;
+    uint16_t param;
+    // Data to write, or data read on completion
+    uint32_t data;
+    // Completion code, or negative on error
+    int16_t result;
+    // Consecutive failures
+    uint8_t errors;
+    peci_callback_t callback;
+    struct PeciRequest * next;
+    bool queued;
+};
+
+// Energy unit before it is read from the CPU
+#define PECI_ENERGY_UNIT_NONE 0xFF
+
 extern int16_t peci_temp;
+extern uint16_t peci_errors;
+extern uint32_t peci_energy;
+extern uint8_t peci_energy_unit;
+extern uint32_t peci_power;
 
 void peci_init(void);
-int peci_wr_pkg_config(uint8_t index, uint16_t param, uint32_t data);
-int peci_update_PL1(int watt);
-int peci_update_PL2(int watt);
-int peci_update_PsysPL2(int watt);
-int peci_update_PL4(int watt);
+bool peci_submit(struct PeciRequest * request);
+bool peci_update_PL1(int watt, peci_callback_t callback);
+bool peci_update_PL2(int watt, peci_callback_t callback);
+bool peci_update_PsysPL2(int watt, peci_callback_t callback);
+bool peci_update_PL4(int watt, peci_callback_t callback);
+void peci_request_event(void);
 void peci_event(void);
 
 #endif // _BOARD_PECI_H
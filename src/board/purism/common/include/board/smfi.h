@@ -3,9 +3,12 @@
 #ifndef _BOARD_SMFI_H
 #define _BOARD_SMFI_H
 
+#include <stdint.h>
+
 void smfi_init(void);
 void smfi_watchdog(void);
 void smfi_event(void);
 void smfi_debug(unsigned char byte);
+void smfi_update_apply(uint32_t size);
 
 #endif // _BOARD_SMFI_H
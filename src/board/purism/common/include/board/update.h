@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef _BOARD_UPDATE_H
+#define _BOARD_UPDATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The EC always runs the image in the first 64 KiB of flash, so updates are
+// staged in the second 64 KiB and copied over when the system is off
+#define UPDATE_SLOT_ADDR 0x10000
+#define UPDATE_SLOT_SIZE 0xF800
+// Header of the staged image, written once it has been verified
+#define UPDATE_HEADER_ADDR 0x1F800
+#define UPDATE_HEADER_SIGNATURE 0x76EC
+// Reserved word of the header, cleared by scratch ROM if applying fails
+#define UPDATE_HEADER_FAILED (UPDATE_HEADER_ADDR + 2)
+// Minimum battery charge in percent to apply a staged update
+#ifndef UPDATE_BATTERY_MIN
+    #define UPDATE_BATTERY_MIN 30
+#endif
+// Maximum bytes programmed or verified per main loop iteration
+#define UPDATE_SLICE 32
+
+void update_init(void);
+bool update_begin(void);
+int16_t update_write(uint32_t offset, __xdata uint8_t * data, uint8_t length);
+bool update_commit(uint32_t size, uint32_t crc);
+uint8_t update_status(void);
+void update_event(void);
+
+#endif // _BOARD_UPDATE_H
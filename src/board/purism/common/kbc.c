@@ -443,3 +443,8 @@ void kbc_event(struct Kbc * kbc) {
         kbc_on_output_empty(kbc);
     }
 }
+
+// No command in progress and no data waiting for the host
+bool kbc_idle(struct Kbc * kbc) {
+    return (state == KBC_STATE_NORMAL) && !(kbc_status(kbc) & KBC_STS_OBF);
+}
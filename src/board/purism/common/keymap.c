@@ -1,12 +1,11 @@
 // SPDX-License-Identifier: GPL-3.0-only
 
+#include <board/config.h>
 #include <board/flash.h>
 #include <board/keymap.h>
 
 uint16_t __xdata DYNAMIC_KEYMAP[KM_LAY][KM_OUT][KM_IN];
 
-// Config is in the last sector of flash
-const uint32_t CONFIG_ADDR = 0x1FC00;
 // Signature is the size of the keymap
 const uint16_t CONFIG_SIGNATURE = sizeof(DYNAMIC_KEYMAP);
 
@@ -34,9 +33,13 @@ bool keymap_erase_config(void) {
     return flash_read_u16(CONFIG_ADDR) == 0xFFFF;
 }
 
+bool keymap_config_valid(void) {
+    return flash_read_u16(CONFIG_ADDR) == CONFIG_SIGNATURE;
+}
+
 bool keymap_load_config(void) {
     // Check signature
-    if (flash_read_u16(CONFIG_ADDR) != CONFIG_SIGNATURE) return false;
+    if (!keymap_config_valid()) return false;
 
     // Read the keymap if signature is valid
     flash_read(CONFIG_ADDR + sizeof(CONFIG_SIGNATURE), (uint8_t *)DYNAMIC_KEYMAP, sizeof(DYNAMIC_KEYMAP));
@@ -44,9 +47,10 @@ bool keymap_load_config(void) {
 }
 
 bool keymap_save_config(void) {
-    // Erase config region
-    if (!keymap_erase_config()) return false;
+    return config_save(CONFIG_KEYMAP);
+}
 
+bool keymap_write_config(void) {
     // Write the keymap
     flash_write(CONFIG_ADDR + sizeof(CONFIG_SIGNATURE), (uint8_t *)DYNAMIC_KEYMAP, sizeof(DYNAMIC_KEYMAP));
 
@@ -54,7 +58,7 @@ bool keymap_save_config(void) {
     flash_write_u16(CONFIG_ADDR, CONFIG_SIGNATURE);
 
     // Verify signature is valid
-    return flash_read_u16(CONFIG_ADDR) == CONFIG_SIGNATURE;
+    return keymap_config_valid();
 }
 
 bool keymap_get(int layer, int output, int input, uint16_t * value) {
@@ -7,8 +7,10 @@
 #include <arch/delay.h>
 #include <arch/time.h>
 #include <board/battery.h>
+#include <board/battery_log.h>
 #include <board/board.h>
 #include <board/ecpm.h>
+#include <board/fan.h>
 #include <board/gpio.h>
 #include <board/gctrl.h>
 #include <board/jack_detect.h>
@@ -24,6 +26,7 @@
 #include <board/pwm.h>
 #include <board/smbus.h>
 #include <board/smfi.h>
+#include <board/update.h>
 #include <board/wdt.h>
 #include <common/debug.h>
 #include <common/macro.h>
@@ -70,6 +73,7 @@ void init(void) {
     pwm_init();
     smbus_init();
     smfi_init();
+    update_init();
     wdt_init(WDT_TMO_26B);
     wdt_enable();
 
@@ -118,11 +122,12 @@ void main(void) {
             if (last_time > time || (time - last_time) >= 1000) {
                 last_time = time;
 
-                // Updates fan status and temps
-                peci_event();
-
                 // Updates battery status
                 battery_event();
+                // Records battery history
+                battery_log_event();
+                // Updates fans that do not follow PECI
+                fan_1s_event();
 
 #if defined(HAVE_JACK_DETECT)
                 jack_detect_1s_event();
@@ -135,12 +140,19 @@ void main(void) {
         // Board-specific events
         board_event();
 
+        // Updates fan status and temps on its own schedule
+        peci_event();
+        // Runs queued PECI transactions
+        peci_request_event();
+
         // Checks for keyboard/mouse packets from host
         kbc_event(&KBC);
         // Handles ACPI communication
         pmc_event(&PMC_1);
         // AP/EC communication over SMFI
         smfi_event();
+        // Programs and applies staged firmware updates
+        update_event();
 
 #if defined(HAVE_JACK_DETECT)
         // Jack detect fast event
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: GPL-3.0-only
 
+#include <arch/time.h>
 #include <board/fan.h>
 #include <board/gpio.h>
 #include <board/peci.h>
@@ -8,53 +9,44 @@
 #include <common/macro.h>
 #include <ec/espi.h>
 #include <ec/gpio.h>
-#include <ec/pwm.h>
 
-// Fan speed is the lowest requested over HEATUP seconds
-#ifndef BOARD_HEATUP
-    #define BOARD_HEATUP 10
-#endif
+// Temperature is sampled every PECI_INTERVAL_FAST ms while it rises by at
+// least PECI_RISE_FAST degrees per second, and every PECI_INTERVAL ms otherwise
+#define PECI_INTERVAL 1000
+#define PECI_INTERVAL_FAST FAN_INTERVAL_MIN
+#define PECI_RISE_FAST 2
 
-static uint8_t FAN_HEATUP[BOARD_HEATUP] = { 0 };
-
-// Fan speed is the highest HEATUP speed over COOLDOWN seconds
-#ifndef BOARD_COOLDOWN
-    #define BOARD_COOLDOWN 10
-#endif
-
-static uint8_t FAN_COOLDOWN[BOARD_COOLDOWN] = { 0 };
+static uint16_t peci_interval = PECI_INTERVAL;
 
 // Tjunction = 100C for i7-10710U (and probably the same for all CML-U)
 #define T_JUNCTION 100
 
 int16_t peci_temp = 0;
 
-#define PECI_TEMP(X) (((int16_t)(X)) << 6)
-
-#define FAN_POINT(T, D) { .temp = PECI_TEMP(T), .duty = PWM_DUTY(D) }
-
-// Fan curve with temperature in degrees C, duty cycle in percent
-static struct FanPoint __code FAN_POINTS[] = {
-#ifdef BOARD_FAN_POINTS
-    BOARD_FAN_POINTS
-#else
-    FAN_POINT(70, 40),
-    FAN_POINT(75, 50),
-    FAN_POINT(80, 60),
-    FAN_POINT(85, 65),
-    FAN_POINT(90, 65)
-#endif
-};
+#define PECI_TEMP(X) FAN_TEMP(X)
 
-static struct Fan __code FAN = {
-    .points = FAN_POINTS,
-    .points_size = ARRAY_SIZE(FAN_POINTS),
-    .heatup = FAN_HEATUP,
-    .heatup_size = ARRAY_SIZE(FAN_HEATUP),
-    .cooldown = FAN_COOLDOWN,
-    .cooldown_size = ARRAY_SIZE(FAN_COOLDOWN),
-    .interpolate = false,
-};
+// Requests are aborted if the controller is busy for longer than this, in ms
+#define PECI_TIMEOUT 10
+
+// Queue of requests, the head is the active request once started
+static struct PeciRequest * peci_queue_head = NULL;
+static struct PeciRequest * peci_queue_tail = NULL;
+static bool peci_active = false;
+static uint32_t peci_start_time = 0;
+
+// Total failed requests, for debugging
+uint16_t peci_errors = 0;
+
+// Package energy is read every PECI_ENERGY_INTERVAL ms, and package power is
+// averaged over the last PECI_ENERGY_SAMPLES reads
+#define PECI_ENERGY_INTERVAL 1000
+#define PECI_ENERGY_SAMPLES 8
+
+// Energy counter, in units of 1/2^peci_energy_unit J
+uint32_t peci_energy = 0;
+uint8_t peci_energy_unit = PECI_ENERGY_UNIT_NONE;
+// Package power in mW
+uint32_t peci_power = 0;
 
 void peci_init(void) {
     // Allow PECI pin to be used
@@ -64,13 +56,26 @@ void peci_init(void) {
     HOCTL2R = HOPTTRS_1MHZ;
     // Set VTT to 1.1V
     PADCTLR = HOVTTS_1_10V;
+
+    fan_init();
 }
 
-// Returns positive completion code on success, negative completion code or
-// negative (0x1000 | status register) on PECI hardware error
-int peci_wr_pkg_config(uint8_t index, uint16_t param, uint32_t data) {
-    // Wait for completion
-    while (HOSTAR & HOBY) {}
+// Queue a request, returns false if it is already queued
+bool peci_submit(struct PeciRequest * request) {
+    if (request->queued) return false;
+
+    request->queued = true;
+    request->next = NULL;
+    if (peci_queue_tail) {
+        peci_queue_tail->next = request;
+    } else {
+        peci_queue_head = request;
+    }
+    peci_queue_tail = request;
+    return true;
+}
+
+static void peci_start(struct PeciRequest * request) {
     // Clear status
     HOSTAR = HOSTAR;
 
@@ -78,48 +83,123 @@ int peci_wr_pkg_config(uint8_t index, uint16_t param, uint32_t data) {
     HOCTLR = FIFOCLR | PECIHEN | AWFCS_EN;
     // Set address to default
     HOTRADDR = 0x30;
-    // Set write length
-    HOWRLR = 10;
-    // Set read length
-    HORDLR = 1;
+
+    switch (request->command) {
+        case PECI_CMD_GET_TEMP:
+            // Set write length
+            HOWRLR = 1;
+            // Set read length
+            HORDLR = 2;
+            break;
+        case PECI_CMD_RD_PKG_CONFIG:
+            HOWRLR = 5;
+            HORDLR = 5;
+            break;
+        case PECI_CMD_WR_PKG_CONFIG:
+            HOWRLR = 10;
+            HORDLR = 1;
+            break;
+    }
     // Set command
-    HOCMDR = 0xA5;
-
-    // Write host ID
-    HOWRDR = 0;
-    // Write index
-    HOWRDR = index;
-    // Write param
-    HOWRDR = (uint8_t)param;
-    HOWRDR = (uint8_t)(param >> 8);
-    // Write data
-    HOWRDR = (uint8_t)data;
-    HOWRDR = (uint8_t)(data >> 8);
-    HOWRDR = (uint8_t)(data >> 16);
-    HOWRDR = (uint8_t)(data >> 24);
+    HOCMDR = request->command;
+
+    if (request->command != PECI_CMD_GET_TEMP) {
+        // Write host ID
+        HOWRDR = 0;
+        // Write index
+        HOWRDR = request->index;
+        // Write param
+        HOWRDR = (uint8_t)request->param;
+        HOWRDR = (uint8_t)(request->param >> 8);
+    }
+    if (request->command == PECI_CMD_WR_PKG_CONFIG) {
+        // Write data
+        HOWRDR = (uint8_t)request->data;
+        HOWRDR = (uint8_t)(request->data >> 8);
+        HOWRDR = (uint8_t)(request->data >> 16);
+        HOWRDR = (uint8_t)(request->data >> 24);
+    }
 
     // Start transaction
     HOCTLR |= START;
+}
 
-    // Wait for completion
-    while (HOSTAR & HOBY) {}
-
-    int status = (int)HOSTAR;
-    if (status & FINISH) {
-        int cc = (int)HORDDR;
-        if (cc & 0x80) {
-            return -cc;
-        } else {
-            return cc;
-        }
+// Read the result of a finished transaction. Sets positive completion code
+// on success, negative completion code or negative (0x1000 | status
+// register) on PECI hardware error. The temperature is the result of
+// GetTemp.
+static void peci_finish(struct PeciRequest * request) {
+    uint8_t status = HOSTAR;
+    if (!(status & FINISH)) {
+        request->result = -(0x1000 | (int16_t)status);
+        return;
+    }
+
+    if (request->command == PECI_CMD_GET_TEMP) {
+        uint8_t low = HORDDR;
+        uint8_t high = HORDDR;
+        request->data = (uint32_t)(int32_t)(int16_t)(((uint16_t)high << 8) | low);
+        request->result = 0;
+        return;
+    }
+
+    int16_t cc = (int16_t)HORDDR;
+    if (request->command == PECI_CMD_RD_PKG_CONFIG) {
+        request->data = (uint32_t)HORDDR;
+        request->data |= ((uint32_t)HORDDR) << 8;
+        request->data |= ((uint32_t)HORDDR) << 16;
+        request->data |= ((uint32_t)HORDDR) << 24;
+    }
+    request->result = (cc & 0x80) ? -cc : cc;
+}
+
+// Advance the request queue, run from the main loop so a stuck PECI bus does
+// not stall the EC
+void peci_request_event(void) {
+    struct PeciRequest * request = peci_queue_head;
+    if (!request) return;
+
+    uint32_t time = time_get();
+    if (!peci_active) {
+        // Only this queue uses the controller, so it is idle between requests
+        peci_start(request);
+        peci_active = true;
+        peci_start_time = time;
+        return;
+    }
+
+    if (HOSTAR & HOBY) {
+        if ((time - peci_start_time) < PECI_TIMEOUT) return;
+
+        // Abort by disabling the host controller
+        HOCTLR = FIFOCLR;
+        request->result = PECI_ERR_TIMEOUT;
     } else {
-        return -(0x1000 | status);
+        peci_finish(request);
+    }
+
+    if (request->result < 0) {
+        request->errors++;
+        peci_errors++;
+    } else {
+        request->errors = 0;
+    }
+
+    // Dequeue before calling back, so the callback can submit again
+    peci_active = false;
+    peci_queue_head = request->next;
+    if (!peci_queue_head) {
+        peci_queue_tail = NULL;
+    }
+    request->queued = false;
+    if (request->callback) {
+        request->callback(request);
     }
 }
 
 #define PECI_INDEX_POWER_LIMITS_PL1             0x1A
 #define PECI_PARAMS_POWER_LIMITS_PL1            0x0000
-#define PECI_PL1_CONTROL_TIME_WINDOWS           ((uint32_t)0xDC) /* 28 seconds */
+#define PECI_PL1_CONTROL_TIME_WINDOWS           ((uint32_t)0xDC << 16) /* 28 seconds */
 #define PECI_PL1_POWER_LIMIT_ENABLE             (0x01 << 15)
 #define PECI_PL1_POWER_LIMIT(x)                 (x << 3)
 
@@ -139,78 +219,206 @@ int peci_wr_pkg_config(uint8_t index, uint16_t param, uint32_t data) {
 #define PECI_PARAMS_POWER_LIMITS_PL4            0x0000
 #define PECI_PL4_POWER_LIMIT(x)                 (x << 3)
 
-int peci_update_PL1(int watt)
-{
-        int rv;
-        uint32_t data;
+static struct PeciRequest peci_pl1_request = { .command = PECI_CMD_WR_PKG_CONFIG };
+static struct PeciRequest peci_pl2_request = { .command = PECI_CMD_WR_PKG_CONFIG };
+static struct PeciRequest peci_psys_pl2_request = { .command = PECI_CMD_WR_PKG_CONFIG };
+static struct PeciRequest peci_pl4_request = { .command = PECI_CMD_WR_PKG_CONFIG };
+
+// Queue a package config write, returns false if not in S0 or the previous
+// write is still queued
+static bool peci_wr_pkg_config(struct PeciRequest * request, uint8_t index, uint16_t param, uint32_t data, peci_callback_t callback) {
+    if (power_state != POWER_STATE_S0) return false;
+    if (request->queued) return false;
+
+    request->index = index;
+    request->param = param;
+    request->data = data;
+    request->callback = callback;
+    return peci_submit(request);
+}
 
-        if (power_state != POWER_STATE_S0)
-                return -1;
+bool peci_update_PL1(int watt, peci_callback_t callback) {
+    uint32_t data = PECI_PL1_CONTROL_TIME_WINDOWS | PECI_PL1_POWER_LIMIT_ENABLE |
+        PECI_PL1_POWER_LIMIT(watt);
+    return peci_wr_pkg_config(&peci_pl1_request, PECI_INDEX_POWER_LIMITS_PL1,
+        PECI_PARAMS_POWER_LIMITS_PL1, data, callback);
+}
 
-        data = PECI_PL1_CONTROL_TIME_WINDOWS | PECI_PL1_POWER_LIMIT_ENABLE |
-                PECI_PL1_POWER_LIMIT(watt);
+bool peci_update_PL2(int watt, peci_callback_t callback) {
+    uint32_t data = PECI_PL2_CONTROL_TIME_WINDOWS | PECI_PL2_POWER_LIMIT_ENABLE |
+        PECI_PL2_POWER_LIMIT(watt);
+    return peci_wr_pkg_config(&peci_pl2_request, PECI_INDEX_POWER_LIMITS_PL2,
+        PECI_PARAMS_POWER_LIMITS_PL2, data, callback);
+}
 
-        rv = peci_wr_pkg_config(PECI_INDEX_POWER_LIMITS_PL1, PECI_PARAMS_POWER_LIMITS_PL1,
-                data);
+bool peci_update_PsysPL2(int watt, peci_callback_t callback) {
+    uint32_t data = PECI_PSYS_PL2_CONTROL_TIME_WINDOWS | PECI_PSYS_PL2_POWER_LIMIT_ENABLE |
+        PECI_PSYS_PL2_POWER_LIMIT(watt);
+    return peci_wr_pkg_config(&peci_psys_pl2_request, PECI_INDEX_POWER_LIMITS_PSYS_PL2,
+        PECI_PARAMS_POWER_LIMITS_PSYS_PL2, data, callback);
+}
 
-        return rv;
+bool peci_update_PL4(int watt, peci_callback_t callback) {
+    if (power_state != POWER_STATE_S0) {
+        ERROR("Can't set PL4 to %d W when not in S0\n", watt);
+        return false;
+    }
+
+    uint32_t data = PECI_PL4_POWER_LIMIT(watt);
+    return peci_wr_pkg_config(&peci_pl4_request, PECI_INDEX_POWER_LIMITS_PL4,
+        PECI_PARAMS_POWER_LIMITS_PL4, data, callback);
 }
 
-int peci_update_PL2(int watt)
-{
-        int rv;
-        uint32_t data;
+#define PECI_INDEX_ENERGY_STATUS                0x03
+#define PECI_PARAMS_ENERGY_STATUS               0x00FF
+
+#define PECI_INDEX_POWER_SKU_UNIT               0x1E
+#define PECI_PARAMS_POWER_SKU_UNIT              0x0000
+#define PECI_ENERGY_UNIT(x)                     ((uint8_t)(((x) >> 8) & 0x1F))
+// Larger units would overflow the conversion to mJ
+#define PECI_ENERGY_UNIT_MAX                    22
+
+struct PeciEnergySample {
+    uint32_t energy;
+    uint32_t time;
+};
+
+static struct PeciEnergySample peci_energy_samples[PECI_ENERGY_SAMPLES];
+static uint8_t peci_energy_head = 0;
+static uint8_t peci_energy_len = 0;
+
+// Queue a package config read, returns false if not in S0 or the previous
+// read is still queued
+static bool peci_rd_pkg_config(struct PeciRequest * request, uint8_t index, uint16_t param) {
+    if (power_state != POWER_STATE_S0) return false;
+    if (request->queued) return false;
 
-        if (power_state != POWER_STATE_S0)
-                return -1;
+    request->index = index;
+    request->param = param;
+    request->data = 0;
+    return peci_submit(request);
+}
 
-        data = PECI_PL2_CONTROL_TIME_WINDOWS | PECI_PL2_POWER_LIMIT_ENABLE |
-                PECI_PL2_POWER_LIMIT(watt);
+// Convert energy counter units to mJ
+static uint32_t peci_energy_mj(uint32_t energy) {
+    uint32_t mask = (((uint32_t)1) << peci_energy_unit) - 1;
+    return (energy >> peci_energy_unit) * 1000 +
+        (((energy & mask) * 1000) >> peci_energy_unit);
+}
 
-        rv = peci_wr_pkg_config(PECI_INDEX_POWER_LIMITS_PL2, PECI_PARAMS_POWER_LIMITS_PL2,
-                data);
+static void peci_unit_done(struct PeciRequest * request) {
+    if (request->result != 0x40) return;
 
-        return rv;
+    uint8_t unit = PECI_ENERGY_UNIT(request->data);
+    if (unit > PECI_ENERGY_UNIT_MAX) {
+        ERROR("PECI energy unit %d not supported\n", unit);
+        return;
+    }
+    peci_energy_unit = unit;
 }
 
-int peci_update_PsysPL2(int watt)
-{
-        int rv;
-        uint32_t data;
+static struct PeciRequest peci_unit_request = {
+    .command = PECI_CMD_RD_PKG_CONFIG,
+    .callback = peci_unit_done,
+};
+
+static void peci_energy_done(struct PeciRequest * request) {
+    if (request->result != 0x40) return;
 
-        if (power_state != POWER_STATE_S0)
-                return -1;
+    uint32_t time = time_get();
+    peci_energy = request->data;
+
+    // Replace the oldest sample once the window is full
+    uint8_t i;
+    if (peci_energy_len < PECI_ENERGY_SAMPLES) {
+        i = (peci_energy_head + peci_energy_len) % PECI_ENERGY_SAMPLES;
+        peci_energy_len++;
+    } else {
+        i = peci_energy_head;
+        peci_energy_head = (peci_energy_head + 1) % PECI_ENERGY_SAMPLES;
+    }
+    peci_energy_samples[i].energy = peci_energy;
+    peci_energy_samples[i].time = time;
+
+    // Average power since the oldest sample, the counter wraps around
+    struct PeciEnergySample * oldest = &peci_energy_samples[peci_energy_head];
+    uint32_t dt = time - oldest->time;
+    if (dt) {
+        peci_power = (peci_energy_mj(peci_energy - oldest->energy) * 1000) / dt;
+    }
+}
 
-        data = PECI_PSYS_PL2_CONTROL_TIME_WINDOWS | PECI_PSYS_PL2_POWER_LIMIT_ENABLE |
-                PECI_PSYS_PL2_POWER_LIMIT(watt);
+static struct PeciRequest peci_energy_request = {
+    .command = PECI_CMD_RD_PKG_CONFIG,
+    .callback = peci_energy_done,
+};
 
-        rv = peci_wr_pkg_config(PECI_INDEX_POWER_LIMITS_PSYS_PL2, PECI_PARAMS_POWER_LIMITS_PSYS_PL2,
-                data);
+static void peci_energy_event(void) {
+    static uint32_t last_time = 0;
+    uint32_t time = time_get();
+    if (last_time <= time && (time - last_time) < PECI_ENERGY_INTERVAL) return;
+    last_time = time;
 
-        return rv;
+    // The energy unit is read once, it does not change while running
+    if (peci_energy_unit == PECI_ENERGY_UNIT_NONE) {
+        peci_rd_pkg_config(&peci_unit_request, PECI_INDEX_POWER_SKU_UNIT,
+            PECI_PARAMS_POWER_SKU_UNIT);
+    } else {
+        peci_rd_pkg_config(&peci_energy_request, PECI_INDEX_ENERGY_STATUS,
+            PECI_PARAMS_ENERGY_STATUS);
+    }
 }
 
-int peci_update_PL4(int watt)
-{
-        int rv;
-        uint32_t data;
+// Forget samples while the CPU is off, its counter does not run
+static void peci_energy_reset(void) {
+    peci_energy_head = 0;
+    peci_energy_len = 0;
+    peci_power = 0;
+}
 
-        if (power_state != POWER_STATE_S0) {
-            ERROR("Can't set PL4 to %d W when not in S0\n", watt);
-            return -1;
-        }
+// Sample faster while temperature rises quickly, so fans respond to bursts
+// before the CPU throttles
+static void peci_schedule(int16_t temp) {
+    static int16_t last_temp = 0;
+    static uint32_t last_time = 0;
+    uint32_t time = time_get();
 
-        data = PECI_PL4_POWER_LIMIT(watt);
+    int32_t rise = ((int32_t)(temp - last_temp)) * 1000;
+    if (last_temp && rise >= ((int32_t)PECI_TEMP(PECI_RISE_FAST)) * (int32_t)(time - last_time)) {
+        peci_interval = PECI_INTERVAL_FAST;
+    } else {
+        peci_interval = PECI_INTERVAL;
+    }
 
-        rv = peci_wr_pkg_config(PECI_INDEX_POWER_LIMITS_PL4, PECI_PARAMS_POWER_LIMITS_PL4,
-                data);
+    last_temp = temp;
+    last_time = time;
+}
 
-        return rv;
+static void peci_temp_done(struct PeciRequest * request) {
+    if (request->result >= 0) {
+        // Use result if finished successfully
+        peci_temp = PECI_TEMP(T_JUNCTION) + (int16_t)request->data;
+        peci_schedule(peci_temp);
+        fan_source_event(FAN_SOURCE_PECI, peci_temp);
+    } else {
+        peci_temp = 0;
+        peci_schedule(peci_temp);
+        fan_source_event(FAN_SOURCE_PECI, FAN_TEMP_INVALID);
+    }
 }
 
+static struct PeciRequest peci_temp_request = {
+    .command = PECI_CMD_GET_TEMP,
+    .callback = peci_temp_done,
+};
+
 // PECI information can be found here: https://www.intel.com/content/dam/www/public/us/en/documents/design-guides/core-i7-lga-2011-guide.pdf
 void peci_event(void) {
-    uint8_t duty;
+    static uint32_t last_time = 0;
+    uint32_t time = time_get();
+    // Only run every peci_interval ms
+    if (last_time <= time && (time - last_time) < peci_interval) return;
+    last_time = time;
 
 #if EC_ESPI
     // Use PECI if CPU is not in C10 state
@@ -220,57 +428,14 @@ void peci_event(void) {
     if (power_state == POWER_STATE_S0)
 #endif // EC_ESPI
     {
-        // Wait for completion
-        while (HOSTAR & HOBY) {}
-        // Clear status
-        HOSTAR = HOSTAR;
-
-        // Enable PECI, clearing data fifo's, enable AW_FCS
-        HOCTLR = FIFOCLR | PECIHEN | AWFCS_EN;
-        // Set address to default
-        HOTRADDR = 0x30;
-        // Set write length
-        HOWRLR = 1;
-        // Set read length
-        HORDLR = 2;
-        // Set command
-        HOCMDR = 1;
-        // Start transaction
-        HOCTLR |= START;
-
-        // Wait for completion
-        while (HOSTAR & HOBY) {}
-
-        if (HOSTAR & FINISH) {
-            // Use result if finished successfully
-            uint8_t low = HORDDR;
-            uint8_t high = HORDDR;
-            uint16_t peci_offset = ((int16_t)high << 8) | (int16_t)low;
-
-            peci_temp = PECI_TEMP(T_JUNCTION) + peci_offset;
-            duty = fan_duty(&FAN, peci_temp);
-        } else {
-            // Default to 50% if there is an error
-            peci_temp = 0;
-            duty = PWM_DUTY(50);
-        }
+        // Fans are updated when the temperature is read
+        peci_submit(&peci_temp_request);
+        peci_energy_event();
     } else {
+        peci_energy_reset();
         // Turn fan off if not in S0 state
         peci_temp = 0;
-        duty = PWM_DUTY(0);
-    }
-
-    if (fan_max) {
-        // Override duty if fans are manually set to maximum
-        duty = PWM_DUTY(100);
-    } else {
-        // Apply heatup and cooldown filters to duty
-        duty = fan_heatup(&FAN, duty);
-        duty = fan_cooldown(&FAN, duty);
-    }
-
-    if (duty != DCR0 || duty != DCR1) {
-        DCR0 = duty;
-        DCR1 = duty;
+        peci_schedule(peci_temp);
+        fan_source_event(FAN_SOURCE_PECI, peci_temp);
     }
 }
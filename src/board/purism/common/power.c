@@ -319,47 +319,163 @@ void power_off_s5(void) {
     update_power_state();
 }
 
-static void power_peci_limit(void) {
-    bool ac;
-    uint8_t watts;
-    static uint8_t last_watts = 0;
-    int res;
-
-    // If not in S0, forget last_watts, because the SoC
-    // does not retain PL4 in any sleep state.
-    if (power_state != POWER_STATE_S0) {
-        if (last_watts) {
-            DEBUG("Not in S0, forget last PL4 of %d W\n", last_watts);
-            last_watts = 0;
-        }
-        return;
+// CPU power limits follow what the supply can deliver and the thermal headroom
+// of the CPU. They are recomputed every POWER_LIMIT_INTERVAL ms, and only
+// written when they move by at least POWER_LIMIT_HYSTERESIS W.
+#define POWER_LIMIT_INTERVAL 1000
+#define POWER_LIMIT_HYSTERESIS 2
+
+// Power used by the rest of the platform in W, not available to the CPU
+#ifndef POWER_PLATFORM_WATTS
+    #define POWER_PLATFORM_WATTS 10
+#endif
+
+// Battery discharge limit in mA
+#ifndef POWER_BATTERY_CURRENT_MAX
+    #define POWER_BATTERY_CURRENT_MAX 3000
+#endif
+
+// Supply limit in W when the battery is at 20% or less, without AC
+#ifndef POWER_LOW_BATTERY_WATTS
+    #define POWER_LOW_BATTERY_WATTS 10
+#endif
+
+// Range of PL1 and the highest PL2 in W, as supported by the CPU
+#ifndef POWER_PL1_MIN
+    #define POWER_PL1_MIN 8
+#endif
+
+#ifndef POWER_PL1_MAX
+    #define POWER_PL1_MAX 15
+#endif
+
+#ifndef POWER_PL2_MAX
+    #define POWER_PL2_MAX 45
+#endif
+
+// PL1 falls from its maximum to POWER_PL1_MIN as the CPU goes from
+// POWER_TEMP_MARGIN degrees C below POWER_TEMP_TARGET to the target
+#ifndef POWER_TEMP_TARGET
+    #define POWER_TEMP_TARGET 95
+#endif
+
+#ifndef POWER_TEMP_MARGIN
+    #define POWER_TEMP_MARGIN 10
+#endif
+
+// Last limits set successfully, 0 if unknown
+static uint8_t power_pl1_watts = 0;
+static uint8_t power_pl2_watts = 0;
+static uint8_t power_pl4_watts = 0;
+
+// Get the limit in W written by a request, or 0 if it failed
+static uint8_t power_peci_limit_result(struct PeciRequest * request) {
+    if (request->result < 0) {
+        ERROR("power_peci_limit failed: 0x%02X\n", -request->result);
+        return 0;
+    } else if (request->result != 0x40) {
+        ERROR("power_peci_limit unknown response: 0x%02X\n", request->result);
+        return 0;
     }
+    return (uint8_t)((request->data >> 3) & 0xFFF);
+}
+
+static void power_pl1_done(struct PeciRequest * request) {
+    power_pl1_watts = power_peci_limit_result(request);
+    DEBUG("PL1 set to %d W\n", power_pl1_watts);
+}
+
+static void power_pl2_done(struct PeciRequest * request) {
+    power_pl2_watts = power_peci_limit_result(request);
+    DEBUG("PL2 set to %d W\n", power_pl2_watts);
+}
+
+static void power_pl4_done(struct PeciRequest * request) {
+    power_pl4_watts = power_peci_limit_result(request);
+    DEBUG("PL4 set to %d W\n", power_pl4_watts);
+}
+
+// Power in W that the adapter or battery can give the CPU
+static uint8_t power_supply_watts(bool ac) {
+    int32_t watts;
 
-    ac = !gpio_get(&ACIN_N);
     if (ac) {
-        if (battery_charger_is_enabled())
-            watts = POWER_LIMIT_DC;
-        else
-            watts = POWER_LIMIT_AC;
-    } else {
-        if (battery_charge > 20) {
-            watts = POWER_LIMIT_DC;
-        } else {
-            watts = POWER_LIMIT_DC_LOW;
+        watts = board_adapter_watts();
+        // Leave the charger its share of the adapter
+        if (battery_charger_is_enabled()) {
+            watts -= ((int32_t)battery_charge_current * (int32_t)battery_voltage) / 1000000;
         }
+    } else {
+        // Keep the battery below its discharge limit
+        watts = ((int32_t)POWER_BATTERY_CURRENT_MAX * (int32_t)battery_voltage) / 1000000;
     }
+    watts -= POWER_PLATFORM_WATTS;
 
-    if (watts == last_watts) {
+    if (!ac && battery_charge <= 20 && watts > POWER_LOW_BATTERY_WATTS) {
+        watts = POWER_LOW_BATTERY_WATTS;
+    }
+
+    if (watts < POWER_PL1_MIN) return POWER_PL1_MIN;
+    if (watts > 255) return 255;
+    return (uint8_t)watts;
+}
+
+// Lower PL1 as the CPU runs out of thermal headroom
+static uint8_t power_pl1_thermal(uint8_t watts) {
+    // Temperature is not known
+    if (peci_temp == 0 || watts <= POWER_PL1_MIN) return watts;
+
+    int16_t headroom = (((int16_t)POWER_TEMP_TARGET) << 6) - peci_temp;
+    if (headroom >= (((int16_t)POWER_TEMP_MARGIN) << 6)) return watts;
+    if (headroom <= 0) return POWER_PL1_MIN;
+
+    return POWER_PL1_MIN + (uint8_t)(
+        (((int32_t)(watts - POWER_PL1_MIN)) * headroom) /
+        (((int16_t)POWER_TEMP_MARGIN) << 6)
+    );
+}
+
+static bool power_limit_changed(uint8_t last, uint8_t watts) {
+    if (!last) return true;
+    if (watts > last) return (watts - last) >= POWER_LIMIT_HYSTERESIS;
+    return (last - watts) >= POWER_LIMIT_HYSTERESIS;
+}
+
+// Recompute CPU power limits, at once if force is set, or every
+// POWER_LIMIT_INTERVAL ms otherwise
+static void power_peci_limit(bool force) {
+    static uint32_t last_time = 0;
+
+    // If not in S0, forget the limits, because the SoC does not retain them
+    // in any sleep state.
+    if (power_state != POWER_STATE_S0) {
+        if (power_pl4_watts) {
+            DEBUG("Not in S0, forget last PL4 of %d W\n", power_pl4_watts);
+        }
+        power_pl1_watts = 0;
+        power_pl2_watts = 0;
+        power_pl4_watts = 0;
         return;
     }
-    res = peci_update_PL4(watts);
-    if (res < 0) {
-        ERROR("power_peci_limit failed: 0x%02X\n", -res);
-    } else if (res != 0x40) {
-        ERROR("power_peci_limit unknown response: 0x%02X\n", res);
-    } else {
-        last_watts = watts;
-        DEBUG("PL4 set to %d W\n", watts);
+
+    uint32_t time = time_get();
+    if (!force && last_time <= time && (time - last_time) < POWER_LIMIT_INTERVAL) return;
+    last_time = time;
+
+    uint8_t pl4 = power_supply_watts(!gpio_get(&ACIN_N));
+    uint8_t pl2 = pl4 < POWER_PL2_MAX ? pl4 : POWER_PL2_MAX;
+    uint8_t pl1 = power_pl1_thermal(pl2 < POWER_PL1_MAX ? pl2 : POWER_PL1_MAX);
+
+    // Results are handled when the writes complete, nothing is queued if the
+    // previous write of a limit is still pending
+    if (power_limit_changed(power_pl4_watts, pl4)) {
+        peci_update_PL4(pl4, power_pl4_done);
+    }
+    if (power_limit_changed(power_pl2_watts, pl2)) {
+        peci_update_PL2(pl2, power_pl2_done);
+    }
+    if (power_limit_changed(power_pl1_watts, pl1)) {
+        peci_update_PL1(pl1, power_pl1_done);
     }
 }
 
@@ -409,7 +525,7 @@ void power_event(void) {
         // Send SCI to update AC and battery information
         ac_send_sci = true;
 
-        power_peci_limit();
+        power_peci_limit(true);
     }
     if (ac_send_sci) {
         // Send SCI 0x16 for AC detect event if ACPI OS is loaded
@@ -512,9 +628,9 @@ void power_event(void) {
         GPIO_SET_DEBUG(LED_AIRPLANE, true);
         GPIO_SET_DEBUG(EC_MUTE_N, true);
 
-        // Set PL4 as soon as possible after transitioning to S0
+        // Set power limits as soon as possible after transitioning to S0
         delay_ms(200);
-        power_peci_limit();
+        power_peci_limit(true);
     } else if(!pg_new && pg_last) {
         DEBUG("%02X: ALL_SYS_PWRGD de-asserted\n", main_cycle);
 
@@ -638,7 +754,7 @@ void power_event(void) {
     static uint32_t last_time = 0;
     static bool dimdir=true;
     uint32_t time = time_get();
-    power_peci_limit();
+    power_peci_limit(false);
     if (power_state == POWER_STATE_S0) {
 #if EC_ESPI
         if (!gpio_get(&CPU_C10_GATE_N)) {
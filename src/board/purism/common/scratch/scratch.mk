@@ -16,8 +16,7 @@ SCRATCH_INCLUDE+=$(wildcard $(SCRATCH_DIR)/include/scratch/*.h) $(SCRATCH_DIR)/s
 SCRATCH_CFLAGS+=-I$(SCRATCH_DIR)/include -D__SCRATCH__
 
 # Add minimal source from other directories
-SCRATCH_SRC+=\
-	$(PURISM_COMMON_DIR)/smfi.c
+SCRATCH_SRC+=$(PURISM_COMMON_DIR)/smfi.c
 
 SCRATCH_BUILD=$(BUILD)/scratch
 SCRATCH_OBJ=$(sort $(patsubst src/%.c,$(SCRATCH_BUILD)/%.rel,$(SCRATCH_SRC)))
@@ -34,10 +33,14 @@ $(BUILD)/include/scratch.h: $(SCRATCH_BUILD)/scratch.rom
 	@mkdir -p $(@D)
 	xxd -s $(SCRATCH_OFFSET) --include < $< > $@
 
-# Convert from Intel Hex file to binary file
+# Convert from Intel Hex file to binary file, failing if the scratch ROM does
+# not fit in the SCAR1 window. The flash ROM follows it at FLASH_OFFSET.
 $(SCRATCH_BUILD)/scratch.rom: $(SCRATCH_BUILD)/scratch.ihx
 	@mkdir -p $(@D)
 	makebin -p < $< > $@
+	@size=$$(($$(wc -c < $@) - $(SCRATCH_OFFSET))); \
+	echo "scratch ROM: $$size of $(SCRATCH_SIZE) bytes"; \
+	if [ $$size -gt $(SCRATCH_SIZE) ]; then rm -f $@; exit 1; fi
 
 # Link object files into Intel Hex file
 $(SCRATCH_BUILD)/scratch.ihx: $(SCRATCH_OBJ)
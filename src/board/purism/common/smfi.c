@@ -13,23 +13,31 @@
 // the command is complete and the result is available. The client should only
 // read the SMFI_CMD_RES value when SMFI_CMD_CMD is set to CMD_NONE.
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
 #ifndef __SCRATCH__
     #include <board/scratch.h>
+    #include <board/flash.h>
+    #include <common/crc.h>
+    #include <board/battery.h>
+    #include <board/battery_log.h>
+    #include <board/fan.h>
     #include <board/jack_detect.h>
+    #include <board/kbc.h>
     #include <board/kbled.h>
     #include <board/kbscan.h>
+    #include <board/peci.h>
 #endif
 #include <board/smfi.h>
+#include <board/update.h>
 #include <common/command.h>
 #include <common/macro.h>
 #include <common/version.h>
 #include <common/debug.h>
 #include <ec/etwd.h>
-#include <ec/pwm.h>
 
 // Shared memory host semaphore
 volatile uint8_t __xdata __at(0x1022) SMHSR;
@@ -71,7 +79,37 @@ static volatile uint8_t __xdata __at(0xE00) smfi_cmd[256];
 #define SMFI_DBG_TAIL 0x00
 static volatile uint8_t __xdata __at(0xF00) smfi_dbg[256];
 
+static uint16_t smfi_cmd_get_u16(uint8_t index) {
+    return ((uint16_t)smfi_cmd[index]) |
+        (((uint16_t)smfi_cmd[index + 1]) << 8);
+}
+
 #if !defined(__SCRATCH__)
+static uint32_t smfi_cmd_get_u32(uint8_t index) {
+    return ((uint32_t)smfi_cmd[index]) |
+        (((uint32_t)smfi_cmd[index + 1]) << 8) |
+        (((uint32_t)smfi_cmd[index + 2]) << 16) |
+        (((uint32_t)smfi_cmd[index + 3]) << 24);
+}
+
+static void smfi_cmd_set_u16(uint8_t index, uint16_t value) {
+    smfi_cmd[index] = (uint8_t)(value);
+    smfi_cmd[index + 1] = (uint8_t)(value >> 8);
+}
+
+static void smfi_cmd_set_u32(uint8_t index, uint32_t value) {
+    smfi_cmd[index] = (uint8_t)(value);
+    smfi_cmd[index + 1] = (uint8_t)(value >> 8);
+    smfi_cmd[index + 2] = (uint8_t)(value >> 16);
+    smfi_cmd[index + 3] = (uint8_t)(value >> 24);
+}
+
+// Set by commands that need more main loop iterations to complete. The same
+// command is run again and CMD_NONE is not set until they are done.
+static bool smfi_cmd_continue = false;
+// Progress of the current command, for commands that continue
+static uint8_t smfi_cmd_progress = 0;
+
 void smfi_init(void) {
     int i;
 
@@ -119,37 +157,130 @@ static enum Result cmd_print(void) {
 }
 
 static enum Result cmd_fan_get(void) {
-    switch (smfi_cmd[SMFI_CMD_DATA]) {
-        case 0:
-            // Get duty of fan 0
-            smfi_cmd[SMFI_CMD_DATA + 1] = DCR0;
-            return RES_OK;
-        case 1:
-            // Get duty of fan 1
-            //TODO: only allow on platforms like addw2
-            smfi_cmd[SMFI_CMD_DATA + 1] = DCR1;
-            return RES_OK;
-    }
-
+    uint8_t index = smfi_cmd[SMFI_CMD_DATA];
     // Failed if fan not found
-    return RES_ERR;
+    if (index >= FAN_COUNT) return RES_ERR;
+
+    // Get duty of fan
+    smfi_cmd[SMFI_CMD_DATA + 1] = fan_pwm_get(index);
+    return RES_OK;
 }
 
 static enum Result cmd_fan_set(void) {
-    switch (smfi_cmd[SMFI_CMD_DATA]) {
-        case 0:
-            // Set duty cycle of fan 0
-            DCR0 = smfi_cmd[SMFI_CMD_DATA + 1];
-            return RES_OK;
-        case 1:
-            // Set duty cycle of fan 1
-            //TODO: only allow on platforms like addw2
-            DCR1 = smfi_cmd[SMFI_CMD_DATA + 1];
-            return RES_OK;
+    uint8_t index = smfi_cmd[SMFI_CMD_DATA];
+    // Failed if fan not found
+    if (index >= FAN_COUNT) return RES_ERR;
+
+    // Set duty cycle of fan
+    fan_pwm_set(index, smfi_cmd[SMFI_CMD_DATA + 1]);
+    return RES_OK;
+}
+
+// Fan curve settings follow the fan index: heatup, cooldown, interpolate,
+// temperature source, number of points, then the temperature and duty of each
+// point
+static enum Result cmd_fan_curve_get(void) {
+    uint8_t index = smfi_cmd[SMFI_CMD_DATA];
+    if (index >= FAN_COUNT) return RES_ERR;
+
+    struct FanConfig config;
+    fan_config_get(index, &config);
+    smfi_cmd[SMFI_CMD_DATA + 1] = config.heatup;
+    smfi_cmd[SMFI_CMD_DATA + 2] = config.cooldown;
+    smfi_cmd[SMFI_CMD_DATA + 3] = config.interpolate;
+    smfi_cmd[SMFI_CMD_DATA + 4] = config.source;
+    smfi_cmd[SMFI_CMD_DATA + 5] = config.points_size;
+    for (uint8_t i = 0; i < config.points_size; i++) {
+        smfi_cmd[SMFI_CMD_DATA + 6 + i * 2] = config.points[i].temp;
+        smfi_cmd[SMFI_CMD_DATA + 7 + i * 2] = config.points[i].duty;
     }
+    return RES_OK;
+}
 
-    // Failed if fan not found
-    return RES_ERR;
+static enum Result cmd_fan_curve_set(void) {
+    uint8_t index = smfi_cmd[SMFI_CMD_DATA];
+    if (index >= FAN_COUNT) return RES_ERR;
+
+    struct FanConfig config;
+    config.heatup = smfi_cmd[SMFI_CMD_DATA + 1];
+    config.cooldown = smfi_cmd[SMFI_CMD_DATA + 2];
+    config.interpolate = smfi_cmd[SMFI_CMD_DATA + 3];
+    config.source = smfi_cmd[SMFI_CMD_DATA + 4];
+    config.points_size = smfi_cmd[SMFI_CMD_DATA + 5];
+    if (config.points_size > FAN_POINTS_MAX) return RES_ERR;
+    for (uint8_t i = 0; i < config.points_size; i++) {
+        config.points[i].temp = smfi_cmd[SMFI_CMD_DATA + 6 + i * 2];
+        config.points[i].duty = smfi_cmd[SMFI_CMD_DATA + 7 + i * 2];
+    }
+
+    // Settings are checked before they are applied and saved
+    if (!fan_config_set(index, &config)) return RES_ERR;
+    if (!fan_save_config(index)) return RES_ERR;
+    return RES_OK;
+}
+
+static enum Result cmd_power_get(void) {
+    // Power is not known until the energy unit has been read
+    if (peci_energy_unit == PECI_ENERGY_UNIT_NONE) return RES_ERR;
+
+    smfi_cmd_set_u32(SMFI_CMD_DATA, peci_power);
+    smfi_cmd_set_u32(SMFI_CMD_DATA + 4, peci_energy);
+    smfi_cmd[SMFI_CMD_DATA + 8] = peci_energy_unit;
+    return RES_OK;
+}
+
+// Battery log chunks start at the requested sequence number, or the oldest
+// sample if it has been overwritten, and hold at most the requested number of
+// samples. The response holds the sequence number of the first sample
+// returned, the sequence number of the next sample to be logged, the logging
+// interval, the number of samples and then the samples. The host reads chunks
+// until it reaches the next sequence number.
+#define BATTERY_LOG_HEADER 11
+#define BATTERY_LOG_SAMPLE 14
+#define BATTERY_LOG_CHUNK \
+    ((sizeof(smfi_cmd) - SMFI_CMD_DATA - BATTERY_LOG_HEADER) / BATTERY_LOG_SAMPLE)
+
+static enum Result cmd_battery_log_get(void) {
+    uint32_t seq = smfi_cmd_get_u32(SMFI_CMD_DATA);
+    uint32_t first = battery_log_first();
+    if (seq < first) seq = first;
+    uint8_t max = smfi_cmd[SMFI_CMD_DATA + 10];
+    if (max == 0 || max > BATTERY_LOG_CHUNK) max = BATTERY_LOG_CHUNK;
+
+    smfi_cmd_set_u32(SMFI_CMD_DATA, seq);
+    smfi_cmd_set_u32(SMFI_CMD_DATA + 4, battery_log_next);
+    smfi_cmd_set_u16(SMFI_CMD_DATA + 8, battery_log_interval);
+
+    uint8_t count = 0;
+    struct BatteryLogSample sample;
+    while (count < max && battery_log_get(seq + count, &sample)) {
+        uint8_t index = SMFI_CMD_DATA + BATTERY_LOG_HEADER + count * BATTERY_LOG_SAMPLE;
+        smfi_cmd_set_u32(index, sample.time);
+        smfi_cmd_set_u16(index + 4, sample.voltage);
+        smfi_cmd_set_u16(index + 6, (uint16_t)sample.current);
+        smfi_cmd_set_u16(index + 8, (uint16_t)sample.temp);
+        smfi_cmd_set_u16(index + 10, sample.status);
+        smfi_cmd[index + 12] = sample.charge;
+        smfi_cmd[index + 13] = sample.charge_state;
+        count++;
+    }
+    smfi_cmd[SMFI_CMD_DATA + 10] = count;
+    return RES_OK;
+}
+
+static enum Result cmd_battery_log_set(void) {
+    battery_log_interval = smfi_cmd_get_u16(SMFI_CMD_DATA);
+    return RES_OK;
+}
+
+static enum Result cmd_battery_time_get(void) {
+    if (!battery_present) return RES_ERR;
+
+    smfi_cmd_set_u32(SMFI_CMD_DATA, battery_power);
+    smfi_cmd[SMFI_CMD_DATA + 4] = battery_power_charging;
+    smfi_cmd_set_u16(SMFI_CMD_DATA + 5, battery_time_to_empty);
+    smfi_cmd_set_u16(SMFI_CMD_DATA + 7, battery_time_to_full);
+    return RES_OK;
 }
 
 static enum Result cmd_keymap_get(void) {
@@ -246,14 +377,208 @@ static enum Result cmd_matrix_get(void) {
     return RES_OK;
 }
 
-#endif // !defined(__SCRATCH__)
+// Output: busy flags (enum CommandBusyFlag), zero when safe to enter scratch ROM
+static enum Result cmd_busy_get(void) {
+    uint8_t flags = 0;
+    for (uint8_t row = 0; row < KM_OUT; row++) {
+        if (kbscan_matrix[row]) {
+            flags |= CMD_BUSY_FLAG_KEYS;
+        }
+    }
+    if (!kbc_idle(&KBC)) {
+        flags |= CMD_BUSY_FLAG_KBC;
+    }
+    uint8_t update = update_status();
+    if (update == CMD_UPDATE_STATE_WRITING || update == CMD_UPDATE_STATE_VERIFYING) {
+        flags |= CMD_BUSY_FLAG_UPDATE;
+    }
+    smfi_cmd[SMFI_CMD_DATA] = flags;
+    return RES_OK;
+}
 
-#if defined(__SCRATCH__)
-static enum Result cmd_spi_scratch(void) __critical {
-    uint8_t flags = smfi_cmd[SMFI_CMD_DATA];
+static enum Result cmd_update_begin(void) {
+    return update_begin() ? RES_OK : RES_ERR;
+}
+
+// Program staged update data, a slice per main loop iteration so keyboard and
+// power handling keep running
+//
+// Input: flags, length, offset (u32), data
+static enum Result cmd_update_write(void) {
     uint8_t len = smfi_cmd[SMFI_CMD_DATA + 1];
+    uint32_t offset = smfi_cmd_get_u32(SMFI_CMD_DATA + 2);
 
-    // Enable chip
+    if ((len + SMFI_CMD_DATA + 6) > ARRAY_SIZE(smfi_cmd)) {
+        return RES_ERR;
+    }
+
+    int16_t count = update_write(
+        offset + smfi_cmd_progress,
+        (uint8_t *)&smfi_cmd[SMFI_CMD_DATA + 6 + smfi_cmd_progress],
+        len - smfi_cmd_progress
+    );
+    if (count < 0) {
+        smfi_cmd_progress = 0;
+        return RES_ERR;
+    }
+
+    smfi_cmd_progress += (uint8_t)count;
+    if (smfi_cmd_progress < len) {
+        smfi_cmd_continue = true;
+    } else {
+        smfi_cmd_progress = 0;
+    }
+    return RES_OK;
+}
+
+// Start verifying the staged update, poll CMD_UPDATE_STATUS for the result
+//
+// Input: size (u32), CRC-32 (u32)
+static enum Result cmd_update_commit(void) {
+    uint32_t size = smfi_cmd_get_u32(SMFI_CMD_DATA);
+    uint32_t crc = smfi_cmd_get_u32(SMFI_CMD_DATA + 4);
+    return update_commit(size, crc) ? RES_OK : RES_ERR;
+}
+
+// Output: state (enum CommandUpdateState)
+static enum Result cmd_update_status(void) {
+    smfi_cmd[SMFI_CMD_DATA] = update_status();
+    return RES_OK;
+}
+
+// Bytes of flash hashed per main loop iteration by CMD_SPI_DIFF, and read
+// through the flash ROM at once
+#define SPI_DIFF_SLICE 64
+#define SPI_DIFF_READ 16
+
+// Flash address, offset in the sector and CRC-32 of the slice being hashed
+static uint32_t spi_diff_addr = 0;
+static uint16_t spi_diff_offset = 0;
+static uint32_t spi_diff_crc = 0;
+
+// Update a CRC-32 with flash data. The running image is read from code
+// memory, the upper 64 KiB through the flash ROM.
+static uint32_t spi_diff_hash(uint32_t crc, uint32_t addr, uint8_t len) {
+    uint8_t i;
+
+    if (addr < 0x10000) {
+        __code uint8_t * code = (__code uint8_t *)(uint16_t)addr;
+        for (i = 0; i < len; i++) {
+            crc = crc32_update(crc, code[i]);
+        }
+    } else {
+        uint8_t data[SPI_DIFF_READ];
+        while (len > 0) {
+            uint8_t count = (len < SPI_DIFF_READ) ? len : SPI_DIFF_READ;
+            flash_read(addr, data, count);
+            for (i = 0; i < count; i++) {
+                crc = crc32_update(crc, data[i]);
+            }
+            addr += count;
+            len -= count;
+        }
+    }
+
+    return crc;
+}
+
+// Compare consecutive sectors of the main ROM against the CRC-32s of a new
+// image, so only a manifest is transferred and the host only has to read
+// back and program the sectors that changed. This runs before entering
+// scratch ROM, a slice per main loop iteration so keyboard and power
+// handling keep running.
+//
+// Input: flags, sector count, address (u32), sector size (u16), one CRC (u32)
+//   per sector at offset 8
+// Output: sectors compared in place of count, bitmap of sectors that differ
+//   at offset 8, overwriting the CRCs
+static enum Result cmd_spi_diff(void) {
+    uint8_t flags = smfi_cmd[SMFI_CMD_DATA];
+    uint8_t count = smfi_cmd[SMFI_CMD_DATA + 1];
+    uint16_t size = smfi_cmd_get_u16(SMFI_CMD_DATA + 6);
+    uint8_t i = smfi_cmd_progress;
+
+    if (i == 0 && spi_diff_offset == 0) {
+        uint32_t addr = smfi_cmd_get_u32(SMFI_CMD_DATA + 2);
+
+        // Only the main ROM can be read without scratch ROM
+        if ((flags & CMD_SPI_FLAG_BACKUP) || (size == 0) ||
+            (((uint16_t)count * 4 + SMFI_CMD_DATA + 8) > ARRAY_SIZE(smfi_cmd)) ||
+            ((addr + (uint32_t)count * size) > 0x20000)) {
+            return RES_ERR;
+        }
+        spi_diff_addr = addr;
+        spi_diff_crc = 0xFFFFFFFF;
+    }
+
+    if (i < count) {
+        uint16_t len = size - spi_diff_offset;
+        if (len > SPI_DIFF_SLICE) len = SPI_DIFF_SLICE;
+        // Slices do not cross from code memory to the flash ROM
+        if (spi_diff_addr < 0x10000 && (0x10000 - spi_diff_addr) < len) {
+            len = (uint16_t)(0x10000 - spi_diff_addr);
+        }
+
+        spi_diff_crc = spi_diff_hash(spi_diff_crc, spi_diff_addr, (uint8_t)len);
+        spi_diff_addr += len;
+        spi_diff_offset += len;
+        if (spi_diff_offset < size) {
+            smfi_cmd_continue = true;
+            return RES_OK;
+        }
+
+        // The bitmap byte of this sector only overlaps CRCs that have been
+        // used, so it can be written now
+        uint8_t index = (i >> 3) + SMFI_CMD_DATA + 8;
+        bool differs = ~spi_diff_crc != smfi_cmd_get_u32(i * 4 + SMFI_CMD_DATA + 8);
+        if ((i & 7) == 0) {
+            smfi_cmd[index] = 0;
+        }
+        if (differs) {
+            smfi_cmd[index] |= 1 << (i & 7);
+        }
+
+        spi_diff_offset = 0;
+        spi_diff_crc = 0xFFFFFFFF;
+        i++;
+        if (i < count) {
+            smfi_cmd_progress = i;
+            smfi_cmd_continue = true;
+            return RES_OK;
+        }
+    }
+
+    // Set actually compared count
+    smfi_cmd[SMFI_CMD_DATA + 1] = i;
+    smfi_cmd_progress = 0;
+    return RES_OK;
+}
+
+// Copy the staged update of size bytes over this firmware from scratch ROM,
+// then reset. Returns without applying if a host command is pending.
+void smfi_update_apply(uint32_t size) {
+    // The host is off, so the command region is unused
+    if (smfi_cmd[SMFI_CMD_CMD] != CMD_NONE) return;
+
+    // Scratch ROM works in pages, to avoid 32-bit math
+    smfi_cmd_set_u16(SMFI_CMD_DATA, (uint16_t)((size + 0xFF) >> 8));
+    smfi_cmd[SMFI_CMD_CMD] = CMD_UPDATE_APPLY;
+    scratch_trampoline();
+}
+#endif // !defined(__SCRATCH__)
+
+static enum Result cmd_reset(void) {
+    // Attempt to trigger watchdog reset
+    ETWCFG |= (1 << 5);
+    EWDKEYR = 0;
+
+    // Failed if it got this far
+    return RES_ERR;
+}
+
+#if defined(__SCRATCH__)
+// Select SPI chip in follow mode
+static void spi_scratch_select(uint8_t flags) {
     if (flags & CMD_SPI_FLAG_BACKUP) {
         ECINDAR3 = 0xFF;
     } else {
@@ -262,6 +587,65 @@ static enum Result cmd_spi_scratch(void) __critical {
     ECINDAR2 = 0xFF;
     ECINDAR1 = 0xFD;
     ECINDAR0 = 0x00;
+}
+
+// Deselect SPI chip, ending the current SPI transaction
+static void spi_scratch_deselect(void) {
+    ECINDAR1 = 0xFE;
+    ECINDDR = 0;
+}
+
+// Wait for SPI chip to finish erase or program, returns false on timeout
+static bool spi_scratch_wait(uint8_t flags) {
+    uint16_t timeout;
+    for (timeout = 0xFFFF; timeout > 0; timeout--) {
+        spi_scratch_select(flags);
+        // Read status register
+        ECINDDR = 0x05;
+        uint8_t status = ECINDDR;
+        spi_scratch_deselect();
+        if (!(status & 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Send a single byte instruction, like write enable and write disable
+static void spi_scratch_instruction(uint8_t flags, uint8_t instruction) {
+    spi_scratch_select(flags);
+    ECINDDR = instruction;
+    spi_scratch_deselect();
+}
+
+#define SPI_PAGE(addr) ((uint16_t)((addr) >> 8))
+
+// Scratch ROM addresses flash by 256 byte page, so it needs no 32-bit math
+static void spi_scratch_address(uint16_t page) {
+    ECINDDR = (uint8_t)(page >> 8);
+    ECINDDR = (uint8_t)(page);
+    ECINDDR = 0;
+}
+
+// Start a fast read at page, data is then read from ECINDDR
+static void spi_scratch_read_at(uint8_t flags, uint16_t page) {
+    // End any previous transaction
+    spi_scratch_select(flags);
+    spi_scratch_deselect();
+
+    spi_scratch_select(flags);
+    ECINDDR = 0x0B;
+    spi_scratch_address(page);
+    // Dummy byte
+    ECINDDR = 0;
+}
+
+static enum Result cmd_spi_scratch(void) __critical {
+    uint8_t flags = smfi_cmd[SMFI_CMD_DATA];
+    uint8_t len = smfi_cmd[SMFI_CMD_DATA + 1];
+
+    // Enable chip
+    spi_scratch_select(flags);
 
     // Read or write len bytes
     uint8_t i;
@@ -278,12 +662,181 @@ static enum Result cmd_spi_scratch(void) __critical {
 
     if (flags & CMD_SPI_FLAG_DISABLE) {
         // Disable chip
-        ECINDAR1 = 0xFE;
-        ECINDDR = 0;
+        spi_scratch_deselect();
     }
 
     return RES_OK;
 }
+
+// Sector buffer for CMD_SPI_PROGRAM. This is xram of the main firmware, which
+// is not running while in scratch ROM.
+#define SPI_BUFFER_SIZE 1024
+static uint8_t __xdata __at(0x000) spi_buffer[SPI_BUFFER_SIZE];
+
+// Fill the sector buffer, so a whole sector is programmed by one command
+//
+// Input: flags, length, offset (u16), data
+// Output: bytes written in place of length
+static enum Result cmd_spi_buffer(void) {
+    uint8_t len = smfi_cmd[SMFI_CMD_DATA + 1];
+    uint16_t offset = smfi_cmd_get_u16(SMFI_CMD_DATA + 2);
+
+    uint8_t i;
+    for (
+        i = 0;
+        (i < len) &&
+        ((i + SMFI_CMD_DATA + 4) < ARRAY_SIZE(smfi_cmd)) &&
+        ((offset + i) < SPI_BUFFER_SIZE);
+        i++
+    ) {
+        spi_buffer[offset + i] = smfi_cmd[i + SMFI_CMD_DATA + 4];
+    }
+
+    // Set actually written count
+    smfi_cmd[SMFI_CMD_DATA + 1] = i;
+
+    return RES_OK;
+}
+
+// Erase a sector if requested, program it from the sector buffer using AAI
+// word programming, then read it back to verify. Only the main ROM is
+// supported.
+static uint8_t spi_scratch_program(uint8_t flags, uint16_t page, uint16_t len) {
+    uint16_t i;
+
+    if ((flags & CMD_SPI_FLAG_BACKUP) || (len > SPI_BUFFER_SIZE) || (len & 1)) {
+        return CMD_SPI_PROGRAM_PARAMETER;
+    }
+
+    if (flags & CMD_SPI_FLAG_ERASE) {
+        spi_scratch_instruction(flags, 0x06);
+        spi_scratch_select(flags);
+        ECINDDR = 0xD7;
+        spi_scratch_address(page);
+        spi_scratch_deselect();
+        if (!spi_scratch_wait(flags)) {
+            return CMD_SPI_PROGRAM_ERASE;
+        }
+    }
+
+    spi_scratch_instruction(flags, 0x06);
+    for (i = 0; i < len; i += 2) {
+        spi_scratch_select(flags);
+        ECINDDR = 0xAD;
+        if (i == 0) {
+            spi_scratch_address(page);
+        }
+        ECINDDR = spi_buffer[i];
+        ECINDDR = spi_buffer[i + 1];
+        spi_scratch_deselect();
+        if (!spi_scratch_wait(flags)) {
+            break;
+        }
+    }
+    // Write disable also ends auto address increment mode
+    spi_scratch_instruction(flags, 0x04);
+    if ((i < len) || !spi_scratch_wait(flags)) {
+        return CMD_SPI_PROGRAM_WRITE;
+    }
+
+    spi_scratch_read_at(flags, page);
+    for (i = 0; i < len; i++) {
+        if (ECINDDR != spi_buffer[i]) {
+            break;
+        }
+    }
+    spi_scratch_deselect();
+    if (i < len) {
+        return CMD_SPI_PROGRAM_VERIFY;
+    }
+
+    return CMD_SPI_PROGRAM_OK;
+}
+
+// Input: flags, address (u32, 256 byte aligned), length (u16)
+// Output: status (enum CommandSpiProgramStatus)
+static enum Result cmd_spi_program(void) __critical {
+    uint8_t flags = smfi_cmd[SMFI_CMD_DATA];
+    uint16_t page = smfi_cmd_get_u16(SMFI_CMD_DATA + 3);
+    uint16_t len = smfi_cmd_get_u16(SMFI_CMD_DATA + 6);
+
+    uint8_t status = CMD_SPI_PROGRAM_PARAMETER;
+    if (!smfi_cmd[SMFI_CMD_DATA + 2] && !smfi_cmd[SMFI_CMD_DATA + 5]) {
+        status = spi_scratch_program(flags, page, len);
+    }
+    smfi_cmd[SMFI_CMD_DATA + 1] = status;
+    return (status == CMD_SPI_PROGRAM_OK) ? RES_OK : RES_ERR;
+}
+
+// Sector buffer copies of an update sector tried before giving up
+#define UPDATE_APPLY_TRIES 3
+
+// Copy one sector of the staged update over page, or erase it if it is past
+// the end of the image. Returns false if it did not verify.
+static bool update_apply_sector(uint16_t page, uint16_t size) {
+    uint16_t len = (page < size) ? SPI_BUFFER_SIZE : 0;
+    uint16_t i;
+    uint8_t tries;
+
+    for (tries = 0; tries < UPDATE_APPLY_TRIES; tries++) {
+        // Restart watchdog timer for every attempt
+        smfi_watchdog();
+        spi_scratch_read_at(0, SPI_PAGE(UPDATE_SLOT_ADDR) + page);
+        for (i = 0; i < len; i++) {
+            spi_buffer[i] = ECINDDR;
+        }
+        spi_scratch_deselect();
+        if (spi_scratch_program(CMD_SPI_FLAG_ERASE, page, len) == CMD_SPI_PROGRAM_OK) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copy the staged update over the first 64 KiB, erasing sectors past its end,
+// then reset into it. Sent by the main firmware when the system is off and
+// the battery is charged.
+//
+// The first sector holds the reset vector, so it is written last, once every
+// other sector has verified. If a sector fails, the first sector is left
+// alone, the staged image is marked as failed so it is not applied on every
+// boot, and the EC resets. Losing power during the copy can still leave a
+// mix of both images.
+//
+// Input: size in pages (u16)
+static enum Result cmd_update_apply(void) __critical {
+    uint16_t size = smfi_cmd_get_u16(SMFI_CMD_DATA);
+    uint16_t page;
+    bool ok = true;
+
+    for (
+        page = SPI_PAGE(SPI_BUFFER_SIZE);
+        ok && (page < SPI_PAGE(UPDATE_SLOT_ADDR));
+        page += SPI_PAGE(SPI_BUFFER_SIZE)
+    ) {
+        ok = update_apply_sector(page, size);
+    }
+    if (ok) {
+        ok = update_apply_sector(0, size);
+    }
+
+    if (ok) {
+        // Forget the staged image, so it is not applied again
+        ok = spi_scratch_program(CMD_SPI_FLAG_ERASE, SPI_PAGE(UPDATE_HEADER_ADDR), 0) == CMD_SPI_PROGRAM_OK;
+    }
+
+    if (!ok) {
+        // Clear the reserved word of the header, programming the signature
+        // over itself
+        spi_buffer[0] = (uint8_t)UPDATE_HEADER_SIGNATURE;
+        spi_buffer[1] = (uint8_t)(UPDATE_HEADER_SIGNATURE >> 8);
+        spi_buffer[2] = 0;
+        spi_buffer[3] = 0;
+        spi_scratch_program(0, SPI_PAGE(UPDATE_HEADER_ADDR), 4);
+    }
+
+    return cmd_reset();
+}
 #endif // defined(__SCRATCH__)
 
 static enum Result cmd_spi(void) {
@@ -299,15 +852,6 @@ static enum Result cmd_spi(void) {
 #endif // defined(__SCRATCH__)
 }
 
-static enum Result cmd_reset(void) {
-    // Attempt to trigger watchdog reset
-    ETWCFG |= (1 << 5);
-    EWDKEYR = 0;
-
-    // Failed if it got this far
-    return RES_ERR;
-}
-
 // Set a watchdog timer of 10 seconds
 void smfi_watchdog(void) {
     ET1CNTLLR = 0xFF;
@@ -323,7 +867,6 @@ void smfi_event(void) {
 #endif
 
         switch (smfi_cmd[SMFI_CMD_CMD]) {
-#if !defined(__SCRATCH__)
             case CMD_PROBE:
                 // Signature
                 smfi_cmd[SMFI_CMD_DATA + 0] = 0x76;
@@ -332,15 +875,24 @@ void smfi_event(void) {
                 smfi_cmd[SMFI_CMD_DATA + 2] = 0x01;
                 // Flags:
                 smfi_cmd[SMFI_CMD_DATA + 3] = 0x00;
+#if defined(__SCRATCH__)
+                // Scratch ROM features, so the host can use them when present
+                smfi_cmd[SMFI_CMD_DATA + 3] |=
+                    CMD_PROBE_FLAG_SCRATCH |
+                    CMD_PROBE_FLAG_SPI_PROGRAM;
+#else // defined(__SCRATCH__)
+                smfi_cmd[SMFI_CMD_DATA + 3] |= CMD_PROBE_FLAG_SPI_DIFF;
 #if defined(HAVE_JACK_DETECT)
                 // Bit 0: Has headphone jack detect.  For boards where EC
                 //   participates in jack detect, indicates to coreboot that it
                 //   can use verbs with jack detect.
-                smfi_cmd[SMFI_CMD_DATA + 3] |= 0x01;
+                smfi_cmd[SMFI_CMD_DATA + 3] |= CMD_PROBE_FLAG_JACK_DETECT;
 #endif
+#endif // defined(__SCRATCH__)
                 // Always successful
                 smfi_cmd[SMFI_CMD_RES] = RES_OK;
                 break;
+#if !defined(__SCRATCH__)
             case CMD_BOARD:
                 strncpy(&smfi_cmd[SMFI_CMD_DATA], board(), ARRAY_SIZE(smfi_cmd) - SMFI_CMD_DATA);
                 // Always successful
@@ -360,6 +912,24 @@ void smfi_event(void) {
             case CMD_FAN_SET:
                 smfi_cmd[SMFI_CMD_RES] = cmd_fan_set();
                 break;
+            case CMD_FAN_CURVE_GET:
+                smfi_cmd[SMFI_CMD_RES] = cmd_fan_curve_get();
+                break;
+            case CMD_FAN_CURVE_SET:
+                smfi_cmd[SMFI_CMD_RES] = cmd_fan_curve_set();
+                break;
+            case CMD_POWER_GET:
+                smfi_cmd[SMFI_CMD_RES] = cmd_power_get();
+                break;
+            case CMD_BATTERY_LOG_GET:
+                smfi_cmd[SMFI_CMD_RES] = cmd_battery_log_get();
+                break;
+            case CMD_BATTERY_LOG_SET:
+                smfi_cmd[SMFI_CMD_RES] = cmd_battery_log_set();
+                break;
+            case CMD_BATTERY_TIME_GET:
+                smfi_cmd[SMFI_CMD_RES] = cmd_battery_time_get();
+                break;
             case CMD_KEYMAP_GET:
                 smfi_cmd[SMFI_CMD_RES] = cmd_keymap_get();
                 break;
@@ -381,6 +951,34 @@ void smfi_event(void) {
             case CMD_MATRIX_GET:
                 smfi_cmd[SMFI_CMD_RES] = cmd_matrix_get();
                 break;
+            case CMD_BUSY_GET:
+                smfi_cmd[SMFI_CMD_RES] = cmd_busy_get();
+                break;
+            case CMD_UPDATE_BEGIN:
+                smfi_cmd[SMFI_CMD_RES] = cmd_update_begin();
+                break;
+            case CMD_UPDATE_WRITE:
+                smfi_cmd[SMFI_CMD_RES] = cmd_update_write();
+                break;
+            case CMD_UPDATE_COMMIT:
+                smfi_cmd[SMFI_CMD_RES] = cmd_update_commit();
+                break;
+            case CMD_UPDATE_STATUS:
+                smfi_cmd[SMFI_CMD_RES] = cmd_update_status();
+                break;
+            case CMD_SPI_DIFF:
+                smfi_cmd[SMFI_CMD_RES] = cmd_spi_diff();
+                break;
+#else // !defined(__SCRATCH__)
+            case CMD_SPI_BUFFER:
+                smfi_cmd[SMFI_CMD_RES] = cmd_spi_buffer();
+                break;
+            case CMD_SPI_PROGRAM:
+                smfi_cmd[SMFI_CMD_RES] = cmd_spi_program();
+                break;
+            case CMD_UPDATE_APPLY:
+                smfi_cmd[SMFI_CMD_RES] = cmd_update_apply();
+                break;
 #endif // !defined(__SCRATCH__)
             case CMD_SPI:
                 smfi_cmd[SMFI_CMD_RES] = cmd_spi();
@@ -394,11 +992,20 @@ void smfi_event(void) {
                 break;
         }
 
+#if !defined(__SCRATCH__)
+        if (smfi_cmd_continue) {
+            // Run the command again in the next main loop iteration
+            smfi_cmd_continue = false;
+            return;
+        }
+#endif
+
         // Mark command as finished
         smfi_cmd[SMFI_CMD_CMD] = CMD_NONE;
     }
 }
 
+#if !defined(__SCRATCH__)
 void smfi_debug(unsigned char byte) {
     int tail = (int)smfi_dbg[SMFI_DBG_TAIL];
     tail++;
@@ -408,3 +1015,4 @@ void smfi_debug(unsigned char byte) {
     smfi_dbg[tail] = byte;
     smfi_dbg[SMFI_DBG_TAIL] = (uint8_t)tail;
 }
+#endif // !defined(__SCRATCH__)
@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-3.0-only
+//
+// Staged firmware updates. The host writes a new image into the staging slot
+// while the system keeps running, a few bytes per main loop iteration. Once
+// the image is verified, it is copied over the running image by the scratch
+// ROM the next time the system is off, with the adapter plugged in and the
+// battery charged.
+
+#include <board/battery.h>
+#include <board/flash.h>
+#include <board/gpio.h>
+#include <board/power.h>
+#include <board/smfi.h>
+#include <board/update.h>
+#include <common/command.h>
+#include <common/crc.h>
+#include <common/debug.h>
+
+// Header layout: signature (u16), reserved (u16), size (u32), CRC-32 (u32)
+#define UPDATE_HEADER_SIZE (UPDATE_HEADER_ADDR + 4)
+#define UPDATE_HEADER_CRC (UPDATE_HEADER_ADDR + 8)
+
+static enum CommandUpdateState update_state = CMD_UPDATE_STATE_NONE;
+static uint32_t update_size = 0;
+static uint32_t update_crc = 0;
+// Progress of verification
+static uint32_t update_offset = 0;
+static uint32_t update_crc_calc = 0;
+
+void update_init(void) {
+    if (flash_read_u16(UPDATE_HEADER_ADDR) == UPDATE_HEADER_SIGNATURE) {
+        update_size = flash_read_u32(UPDATE_HEADER_SIZE);
+        update_crc = flash_read_u32(UPDATE_HEADER_CRC);
+        if (flash_read_u16(UPDATE_HEADER_FAILED) != 0xFFFF) {
+            // Do not retry on every boot, the host has to stage it again
+            ERROR("Update of %ld bytes failed to apply\n", update_size);
+            update_state = CMD_UPDATE_STATE_ERROR;
+            return;
+        }
+        update_state = CMD_UPDATE_STATE_READY;
+        INFO("Update of %ld bytes staged\n", update_size);
+    }
+}
+
+bool update_begin(void) {
+    // Forget any staged image, sectors are erased as they are written
+    flash_erase(UPDATE_HEADER_ADDR);
+    if (flash_read_u16(UPDATE_HEADER_ADDR) != 0xFFFF) {
+        update_state = CMD_UPDATE_STATE_ERROR;
+        return false;
+    }
+
+    update_state = CMD_UPDATE_STATE_WRITING;
+    return true;
+}
+
+// Program up to UPDATE_SLICE bytes without crossing a sector, erasing the
+// sector first when writing its start. The image has to be written in order.
+// Returns bytes written, or -1 on error.
+int16_t update_write(uint32_t offset, __xdata uint8_t * data, uint8_t length) {
+    if (update_state != CMD_UPDATE_STATE_WRITING) return -1;
+    if ((offset + length) > UPDATE_SLOT_SIZE) return -1;
+
+    uint16_t remaining = 1024 - (uint16_t)(offset & 0x3FF);
+    if (length > UPDATE_SLICE) length = UPDATE_SLICE;
+    if (length > remaining) length = (uint8_t)remaining;
+    if (length == 0) return 0;
+
+    if ((offset & 0x3FF) == 0) {
+        // This will erase 1024 bytes
+        flash_erase(UPDATE_SLOT_ADDR + offset);
+    }
+    flash_write(UPDATE_SLOT_ADDR + offset, data, length);
+
+    return length;
+}
+
+bool update_commit(uint32_t size, uint32_t crc) {
+    if (update_state != CMD_UPDATE_STATE_WRITING) return false;
+    if (size == 0 || size > UPDATE_SLOT_SIZE) return false;
+
+    update_size = size;
+    update_crc = crc;
+    update_offset = 0;
+    update_crc_calc = 0xFFFFFFFF;
+    update_state = CMD_UPDATE_STATE_VERIFYING;
+    return true;
+}
+
+uint8_t update_status(void) {
+    return (uint8_t)update_state;
+}
+
+static void update_verify(void) {
+    uint8_t data[UPDATE_SLICE];
+    uint8_t length = UPDATE_SLICE;
+    if ((update_size - update_offset) < length) {
+        length = (uint8_t)(update_size - update_offset);
+    }
+
+    flash_read(UPDATE_SLOT_ADDR + update_offset, data, length);
+    for (uint8_t i = 0; i < length; i++) {
+        update_crc_calc = crc32_update(update_crc_calc, data[i]);
+    }
+    update_offset += length;
+    if (update_offset < update_size) return;
+
+    if (~update_crc_calc != update_crc) {
+        ERROR("Update CRC 0x%lX does not match 0x%lX\n", ~update_crc_calc, update_crc);
+        update_state = CMD_UPDATE_STATE_ERROR;
+        return;
+    }
+
+    flash_write_u32(UPDATE_HEADER_SIZE, update_size);
+    flash_write_u32(UPDATE_HEADER_CRC, update_crc);
+    // Write the signature last, so only complete headers are valid
+    flash_write_u16(UPDATE_HEADER_ADDR, UPDATE_HEADER_SIGNATURE);
+    if (flash_read_u16(UPDATE_HEADER_ADDR) != UPDATE_HEADER_SIGNATURE) {
+        update_state = CMD_UPDATE_STATE_ERROR;
+        return;
+    }
+
+    INFO("Update of %ld bytes ready\n", update_size);
+    update_state = CMD_UPDATE_STATE_READY;
+}
+
+void update_event(void) {
+    switch (update_state) {
+        case CMD_UPDATE_STATE_VERIFYING:
+            update_verify();
+            break;
+        case CMD_UPDATE_STATE_READY:
+            // Losing power while copying would leave no bootable image, so
+            // wait until the system is off, on AC, and the battery could
+            // carry the copy if the adapter is unplugged
+            if (
+                power_state == POWER_STATE_DS5 &&
+                !gpio_get(&ACIN_N) &&
+                battery_present &&
+                battery_charge >= UPDATE_BATTERY_MIN
+            ) {
+                INFO("Applying update\n");
+                smfi_update_apply(update_size);
+            }
+            break;
+    }
+}
@@ -114,6 +114,7 @@ void board_init(void) {
 
 void board_on_ac(bool ac) {
     DEBUG("board ac %s\n", ac ? "t" : "f");
+    board_battery_on_ac(ac);
 }
 
 // called every main loop cycle, careful
@@ -127,42 +128,30 @@ void board_event(void) {
             last_kbc_leds = kbc_leds;
         }
     }
+
+    adc_event();
+    board_battery_event();
 }
 
 bool board_jack_detect_sense(bool last_sense)
 {
-    // The new measurement is normally ready by now.  If it is not, we will
-    // fall back to the last measured state and check again next time.
-    bool result = last_sense;
-
-    if(VCH2CTL & (1<<7)) {
-        // Measurement is ready
-        uint16_t hp_jack_measurement = VCH2DATM;
-        hp_jack_measurement <<= 8;
-        hp_jack_measurement |= VCH2DATL;
-
-        // No jack (open circuit) is 3 V.  A plugged jack is around 0.8 V, but
-        // it varies because the sense pin on the NJP402 headphone jack (pin 4)
-        // shorts to the left channel (not ground).  (This is the plug tip, the
-        // last pin to make and the first to break.)
-        //
-        // Use a threshold of ~2.5 V to decide whether the jack is plugged.
-        result = hp_jack_measurement <= 850;
-
-        // Start another measurement, write 1 to the status bit to clear it.
-        VCH2CTL |= (1<<7);
-    }
-
-    return result;
+    // Fall back to the last measured state until the ADC has a value
+    if (!adc_ready(2))
+        return last_sense;
+
+    // No jack (open circuit) is 3 V.  A plugged jack is around 0.8 V, but
+    // it varies because the sense pin on the NJP402 headphone jack (pin 4)
+    // shorts to the left channel (not ground).  (This is the plug tip, the
+    // last pin to make and the first to break.)
+    //
+    // Use a threshold of ~2.5 V to decide whether the jack is plugged.
+    return adc_get(2) <= (850 << ADC_FRACTION_BITS);
 }
 
 void board_jack_detect_activate(void)
 {
-    // Start a new measurement, so at the next sense we do not use a stale
-    // measurement that has been sitting around since the jack detect was last
-    // enabled.  It's OK if a measurement is already ongoing and this has no
-    // effect, because that measurement is recent.
-    VCH2CTL |= (1<<7);
+    // The jack detect channel converts all the time in adc_event, so its
+    // value is never stale
 }
 
 // called once per second
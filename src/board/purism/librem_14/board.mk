@@ -11,6 +11,8 @@ KBLED=white_pwm
 
 # Set charger I2C bus
 CFLAGS+=-DI2C_SMBUS=I2C_3
+# Dump charger registers on every enable and disable
+#CFLAGS+=-DCHARGER_DEBUG
 
 # Set battery I2C bus
 CFLAGS+=-DI2C_BATTERY=I2C_0
@@ -21,9 +23,15 @@ CFLAGS+=-DI2C_DEBUG_BUS=I2C_0
 CFLAGS+=-DHAVE_LID_SW
 CFLAGS+=-DHAVE_JACK_DETECT
 
+# Fans on DCR0 and DCR1, both cooling the CPU
+CFLAGS+=-DBOARD_FANS=2
+
 # Custom fan curve
 CFLAGS+=-DBOARD_HEATUP=5
 CFLAGS+=-DBOARD_COOLDOWN=20
+# Longest heatup and cooldown that can be set at runtime
+CFLAGS+=-DBOARD_HEATUP_MAX=10
+CFLAGS+=-DBOARD_COOLDOWN_MAX=30
 CFLAGS+=-DBOARD_FAN_POINTS="\
 	FAN_POINT(50, 20), \
 	FAN_POINT(55, 25), \
@@ -35,11 +43,21 @@ CFLAGS+=-DBOARD_FAN_POINTS="\
 	FAN_POINT(85, 90), \
 	FAN_POINT(90, 100) \
 "
-# Set CPU power limits in watts
+# Full fan speed in RPM, enables closed-loop control of the fan curve
+#CFLAGS+=-DBOARD_FAN_MAX_RPM=5000
+# Ramp fans toward the temperature expected in this many seconds, while the CPU
+# package draws at least BOARD_FAN_LOOKAHEAD_POWER W
+#CFLAGS+=-DBOARD_FAN_LOOKAHEAD=5 -DBOARD_FAN_LOOKAHEAD_POWER=15
+# Set CPU power supply and limits in watts, battery discharge limit in mA.
+# POWER_ADAPTER_WATTS is the shipped 90 W adapter, smaller ones are derated
+# when they drop out under load.
 CFLAGS+=\
-	-DPOWER_LIMIT_AC=65 \
-	-DPOWER_LIMIT_DC=25 \
-	-DPOWER_LIMIT_DC_LOW=10
+	-DPOWER_ADAPTER_WATTS=90 \
+	-DPOWER_PLATFORM_WATTS=8 \
+	-DPOWER_BATTERY_CURRENT_MAX=3000 \
+	-DPOWER_LOW_BATTERY_WATTS=10 \
+	-DPOWER_PL1_MAX=25 \
+	-DPOWER_PL2_MAX=51
 
 # Add purism common code
 include src/board/purism/common/common.mk
@@ -2,12 +2,14 @@
 
 #include <stdbool.h>
 #include <arch/delay.h>
+#include <arch/time.h>
 #include <board/battery.h>
 #include <board/board.h>
 #include <board/smbus.h>
 #include <board/gpio.h>
 //#include <common/i2c.h>
 #include <ec/adc.h>
+#include <ec/bram.h>
 #include <ec/i2c.h>
 #include <common/debug.h>
 
@@ -20,17 +22,206 @@
 static uint16_t last_voltage_read = 0;
 static bool sbs_battery = false;
 
+//
+// Batteries without a gas gauge get a coulomb counter, which integrates the
+// ADC current every battery_event. On AC the ADC only measures the adapter
+// current, so the charge current is estimated from it, see
+// adapter_charge_current. It is set to full when the charger tapers
+// off at the charge voltage, and to empty at the cutoff voltage. When a full
+// discharge follows a full charge, the counted charge becomes the full
+// capacity. The count is kept in BRAM, so it survives EC resets.
+//
+
+// Battery is empty this close to its minimum voltage, in mV
+#define COULOMB_EMPTY_MARGIN 150
+// Battery is full this close to its charge voltage, in mV
+#define COULOMB_FULL_MARGIN 100
+// Calibration points must hold for this many samples
+#define COULOMB_CALIBRATE_SAMPLES 5
+// A saved count is not trusted if it differs this much from the voltage
+// based estimate, in %
+#define COULOMB_RESTORE_DIFF 30
+
+// BRAM_COULOMB_FLAGS holds this when the saved count is valid
+#define COULOMB_SAVED 0xC5
+
+// Charge relative to empty, in mAs, can go below zero until calibrated
+static int32_t coulomb_mas = 0;
+static uint32_t coulomb_time = 0;
+// Count was restored from BRAM or estimated from the voltage
+static bool coulomb_started = false;
+// Count started at a full calibration, so the full capacity can be learned
+static bool coulomb_from_full = false;
+static uint8_t coulomb_full_samples = 0;
+static uint8_t coulomb_empty_samples = 0;
+
+static uint16_t adapter_charge_current(uint16_t adapter);
+
+//
+// guess battery charge in % (0-100) from the battery voltage
+//
+static uint16_t voltage_charge(uint16_t tvol)
+{
+uint16_t bchgst;
+
+    if (tvol <= battery_min_voltage)
+        return 0;
+    tvol -= battery_min_voltage; // lower threshold, = 0%
+
+    if (gpio_get(&ACIN_N)) {
+        // unplugged
+        bchgst = ((30000 / (battery_design_voltage-battery_min_voltage)) * tvol) / 300;
+    } else {
+        // plugged
+        bchgst = ((30000 / (battery_charge_voltage-battery_min_voltage)) * tvol) / 300;
+    }
+
+    if (bchgst > 100)
+        bchgst = 100;
+
+    return bchgst;
+}
+
+static uint16_t coulomb_mah(void)
+{
+    if (coulomb_mas <= 0)
+        return 0;
+    return (uint16_t)(coulomb_mas / 3600);
+}
+
+static uint16_t coulomb_charge(void)
+{
+    uint32_t charge;
+
+    if (battery_full_capacity == 0)
+        return 0;
+
+    charge = ((uint32_t)coulomb_mah() * 100) / battery_full_capacity;
+    if (charge > 100)
+        charge = 100;
+    return (uint16_t)charge;
+}
+
+static void coulomb_save(void)
+{
+    uint16_t mah = coulomb_mah();
+
+    if (BRAM[BRAM_COULOMB_FLAGS] == COULOMB_SAVED &&
+        BRAM[BRAM_COULOMB_CHARGE_L] == (uint8_t)mah &&
+        BRAM[BRAM_COULOMB_CHARGE_H] == (uint8_t)(mah >> 8) &&
+        BRAM[BRAM_COULOMB_FULL_L] == (uint8_t)battery_full_capacity &&
+        BRAM[BRAM_COULOMB_FULL_H] == (uint8_t)(battery_full_capacity >> 8))
+        return;
+
+    bram_set_value(BRAM_COULOMB_CHARGE_L, (uint8_t)mah);
+    bram_set_value(BRAM_COULOMB_CHARGE_H, (uint8_t)(mah >> 8));
+    bram_set_value(BRAM_COULOMB_FULL_L, (uint8_t)battery_full_capacity);
+    bram_set_value(BRAM_COULOMB_FULL_H, (uint8_t)(battery_full_capacity >> 8));
+    bram_set_value(BRAM_COULOMB_FLAGS, COULOMB_SAVED);
+}
+
+// start counting from the saved count, or from the voltage if there is none
+// or it does not match the battery
+static void coulomb_start(void)
+{
+uint16_t estimate = voltage_charge(last_voltage_read);
+uint16_t full;
+int16_t diff;
+
+    if (BRAM[BRAM_COULOMB_FLAGS] == COULOMB_SAVED) {
+        full = BRAM[BRAM_COULOMB_FULL_L] | ((uint16_t)BRAM[BRAM_COULOMB_FULL_H] << 8);
+        // learned capacity must be within 50% to 110% of the design capacity
+        if ((full >= battery_design_capacity / 2) &&
+            (full <= battery_design_capacity + battery_design_capacity / 10))
+            battery_full_capacity = full;
+
+        coulomb_mas = (int32_t)(BRAM[BRAM_COULOMB_CHARGE_L] | ((uint16_t)BRAM[BRAM_COULOMB_CHARGE_H] << 8)) * 3600;
+        diff = (int16_t)coulomb_charge() - (int16_t)estimate;
+        if ((diff < COULOMB_RESTORE_DIFF) && (diff > -COULOMB_RESTORE_DIFF)) {
+            DEBUG("coulomb restored %d mAh of %d\n", coulomb_mah(), battery_full_capacity);
+            coulomb_started = true;
+            return;
+        }
+        DEBUG("coulomb saved %d%% but voltage %d%%\n", coulomb_charge(), estimate);
+    }
+
+    coulomb_mas = ((int32_t)battery_full_capacity * estimate / 100) * 3600;
+    coulomb_started = true;
+}
+
+// integrate the current since the last update and calibrate at full and empty
+static void coulomb_update(void)
+{
+uint32_t time = time_get();
+uint32_t dt = time - coulomb_time;
+int32_t full_mas = (int32_t)battery_full_capacity * 3600;
+bool ac = !gpio_get(&ACIN_N);
+uint16_t full;
+
+    coulomb_time = time;
+    if (!coulomb_started) {
+        coulomb_start();
+        return;
+    }
+
+    // battery_current is negative when discharging
+    if (dt > 10000)
+        dt = 10000;
+    coulomb_mas += ((int32_t)(int16_t)battery_current * (int32_t)dt) / 1000;
+
+    // full when the charge current tapers below C/20 at the charge voltage
+    if (ac && battery_charger_is_enabled() &&
+        (last_voltage_read + COULOMB_FULL_MARGIN >= battery_charge_voltage) &&
+        ((int16_t)battery_current <= (int16_t)(battery_full_capacity / 20))) {
+        if (coulomb_full_samples < COULOMB_CALIBRATE_SAMPLES)
+            coulomb_full_samples++;
+    } else {
+        coulomb_full_samples = 0;
+    }
+
+    if (!ac && (last_voltage_read <= battery_min_voltage + COULOMB_EMPTY_MARGIN)) {
+        if (coulomb_empty_samples < COULOMB_CALIBRATE_SAMPLES)
+            coulomb_empty_samples++;
+    } else {
+        coulomb_empty_samples = 0;
+    }
+
+    if (coulomb_full_samples == COULOMB_CALIBRATE_SAMPLES) {
+        if (coulomb_mas != full_mas)
+            DEBUG("coulomb full at %d mAh\n", coulomb_mah());
+        coulomb_mas = full_mas;
+        coulomb_from_full = true;
+    } else if (coulomb_empty_samples == COULOMB_CALIBRATE_SAMPLES) {
+        if (coulomb_from_full) {
+            // what is left of the count was never there, or more was there
+            // when it went below zero
+            full = (uint16_t)((full_mas - coulomb_mas) / 3600);
+            if ((full >= battery_design_capacity / 2) &&
+                (full <= battery_design_capacity + battery_design_capacity / 10)) {
+                DEBUG("coulomb learned %d mAh\n", full);
+                battery_full_capacity = full;
+            }
+            coulomb_from_full = false;
+        }
+        if (coulomb_mas != 0)
+            DEBUG("coulomb empty at %d mAh\n", coulomb_mah());
+        coulomb_mas = 0;
+    } else if (coulomb_mas > full_mas) {
+        // charging past full is lost to heat
+        coulomb_mas = full_mas;
+    }
+
+    coulomb_save();
+}
+
 //
 // returns battery charge in % (0-100)
 // based on last battery readings
 //
 uint16_t board_battery_get_charge(void)
 {
-uint16_t tvol;
 uint16_t bchgst;
-unsigned char ravg=0; // rolling average
-static unsigned char ravg2=0;
-static unsigned char ravg3=0;
+unsigned char ravg=0;
 
     if (sbs_battery) {
         int res;
@@ -49,37 +240,21 @@ static unsigned char ravg3=0;
         if (battery_design_voltage == 0)
             return 0;
 
-        tvol=last_voltage_read;
-        tvol -= battery_min_voltage; // lower threshold, = 0%
-        if (gpio_get(&ACIN_N)) {
-            // unplugged
-            bchgst = ((30000 / (battery_design_voltage-battery_min_voltage)) * tvol) / 300;
-        } else {
-            // plugged
-            bchgst = ((30000 / (battery_charge_voltage-battery_min_voltage)) * tvol) / 300;
-        }
-
-        if (bchgst > 100)
-            bchgst = 100;
-
-        ravg3 = ravg2;
-        ravg2 = bchgst;
-        ravg = (ravg2 + ravg3 + bchgst) / 3;
+        coulomb_update();
 
-        battery_remaining_capacity = (battery_design_capacity / 100) * ravg; // guess based on voltage
+        ravg = coulomb_charge();
+        battery_remaining_capacity = coulomb_mah();
     }
 
-    return ravg; // in % from 0 to 100 - hopefully
+    return ravg; // in % from 0 to 100
 }
 
 //
 // reads current battery voltage in mV
-// in Librem 14 from EC ADC channel 1
+// in Librem 14 from EC ADC input 1 on VCH0
 //
 uint16_t board_battery_get_voltage(void)
 {
-uint8_t to=0;
-uint16_t adcval;
 uint16_t tvol;
 
     if (sbs_battery) {
@@ -90,19 +265,11 @@ uint16_t tvol;
         }
         //DEBUG("SBS %dmV\n", tvol);
     } else {
-        // we may have to wait for ADC to finish
-        while (to++ < 100 && !(VCH0CTL & (1L << 7)))
-            delay_us(100);
-
-        if (!(VCH0CTL & (1L << 7)))
-            DEBUG("BAT !adc sts=0x%02x ctl=0x%02x\n", ADCSTS, VCH0CTL);
+        if (!adc_ready(0))
+            DEBUG("BAT !adc\n");
 
-        adcval = (((uint16_t)VCH0DATM & 0x03) << 8) | VCH0DATL;
-        // max bat voltage at max ADC value = 15.4V
-        tvol = ((14000000 / 0x3ff) * adcval) / 1000;
-
-        // clear ADC to start new cycle
-        VCH0CTL |= (1L << 7);
+        // max bat voltage at max ADC value = 14V
+        tvol = ((uint32_t)adc_get(0) * 14000) / ADC_MAX;
 
         last_voltage_read = tvol;
 
@@ -112,20 +279,34 @@ uint16_t tvol;
     return tvol;
 }
 
+//
+// sense voltage of charge / discharge current in 0.1mV,
+// from EC ADC input 0 on VCH1
+// EC ADC 10 bit 3Vmax
+//
+static uint16_t sense_voltage(void)
+{
+    if (!adc_ready(1))
+        DEBUG("CUR !adc\n");
+
+    return ((uint32_t)adc_get(1) * 30000) / ADC_MAX;
+}
+
 //
 // reads charge / discharge current
-// in Librem 14 from EC ADC channel 0
+// in Librem 14 from EC ADC input 0 on VCH1
 // sense resistor 0.01 Ohm,
-// charging: IOUT x 40
+// on AC: IOUT x 40, adapter current as ChargeOption0 has FIX_IOUT set and
+//   IOUT_SEL clear
 // discharging: IOUT x 16
 // EC ADC 10 bit 3Vmax
 // 3V / 0x3ff * ADC = VADC
-// (VADC / 0.01) / 40 = Icharge
-// (VADC / 0.01) / 16 = Icharge
+// (VADC / 0.01) / 40 = Iadapter
+// (VADC / 0.01) / 16 = Idischarge
+// like SBS Current(), a discharge current is returned as a negative value
 //
 uint16_t board_battery_get_current(void)
 {
-uint8_t to=0;
 uint16_t adcval;
 
     if (sbs_battery) {
@@ -135,28 +316,14 @@ uint16_t adcval;
             DEBUG(" 0x0A r=%d\n", res);
         }
     } else {
-        // we may have to wait for ADC to finish
-        while (to++ < 100 && !(VCH1CTL & (1L << 7)))
-            delay_us(100);
-
-        if (!(VCH1CTL & (1L << 7)))
-            DEBUG("CUR !adc sts=0x%02x ctl=0x%02x\n", ADCSTS, VCH1CTL);
-
-        adcval = (((uint16_t)VCH1DATM & 0x03) << 8) | VCH1DATL;
-
-        // DEBUG("cur raw: %d ", adcval);
-
-        // clear ADC to start new cycle
-        VCH1CTL |= (1L << 7);
-
-        adcval = adcval * (30000 / 0x3ff); // = sense voltage
+        adcval = sense_voltage();
         if (gpio_get(&ACIN_N))
-            adcval = (adcval / (16)) * 10;	// no AC, discharge current
+            adcval = -(int16_t)((adcval / (16)) * 10);	// no AC, discharge current
         else
-            adcval = adcval / (4);		// on AC, charge current
+            adcval = adapter_charge_current(adcval / (4));	// on AC, charge current from adapter current
     }
 
-    DEBUG("bat %dmA\n", adcval);
+    DEBUG("bat %dmA\n", (int16_t)adcval);
     battery_current = adcval;
 
     return battery_current;
@@ -165,35 +332,20 @@ uint16_t adcval;
 // this should return the total currently consumed power
 uint16_t board_get_current(void)
 {
-uint8_t to=0;
 uint16_t adcval;
 
     if (!gpio_get(&ACIN_N)) { // running from charger
-        // we may have to wait for ADC to finish
-        while (to++ < 100 && !(VCH1CTL & (1L << 7)))
-            delay_us(100);
-
-        if (!(VCH1CTL & (1L << 7)))
-            DEBUG("CUR !adc sts=0x%02x ctl=0x%02x\n", ADCSTS, VCH1CTL);
-
-        adcval = (((uint16_t)VCH1DATM & 0x03) << 8) | VCH1DATL;
-
-        DEBUG("cur raw: %d (0x%02x 0x%02x) ", adcval, VCH1DATM, VCH1DATL);
-
-        // clear ADC to start new cycle
-        VCH1CTL |= (1L << 7);
-
-        adcval = adcval * (30000 / 0x3ff); // = sense voltage (3V ADC ref)
+        adcval = sense_voltage();
         adcval = adcval / (4);		   // primary current from charger
 
         DEBUG("sys %dmA\n", adcval);
         return adcval;
     } else {
-        return battery_current;
+        // the battery supplies everything, it reports the discharge as negative
+        return (int16_t)battery_current < 0 ? -(int16_t)battery_current : 0;
     }
 }
 
-
 static bool read_eeprom(void)
 {
 int res;
@@ -245,8 +397,12 @@ uint16_t max_discharge_current;
     res = i2c_get(&I2C_0, BAT_EEPROM_ADR, 0x0C, &charge_current, 2);
     if (res < 0)
         charge_current = 0;
-    else
+    else {
         battery_charge_current = charge_current;
+        // the pack can not request anything, charge at its standard current
+        battery_charge_max_current = charge_current;
+        battery_requested_current = charge_current;
+    }
 
     DEBUG("  VID:      0x%02x\n", vendor_id);
     DEBUG("  cell ID:  0x%02x\n", cell_brand_id);
@@ -258,7 +414,7 @@ uint16_t max_discharge_current;
     DEBUG("  des-volt: %dmV\n", design_voltage);
     DEBUG("  dis-cur:  %dmA\n", max_discharge_current);
 
-    battery_temp = 20; // no thermistor, assume 20C ?
+    battery_temp = 200; // no thermistor, assume 20C, in 0.1 degrees C
     battery_min_voltage = 9600;
 
     battery_current = 0; // we have no means to tell the current/rate
@@ -320,65 +476,162 @@ int res;
 // standard discharge: 0.2C (1760mA)
 // max. discharge:
 
-static void update_gas_gauge(void)
+// Runtime SBS registers are read in the background by board_battery_event, one
+// transaction per SBS_SLOT_INTERVAL ms, so a flaky battery contact does not
+// stall the main loop. Each register is polled at its own interval, by how
+// fast it changes. A failed read is tried again in a later slot, up to
+// SBS_TRIES times per interval.
+#define SBS_SLOT_INTERVAL 10
+#define SBS_TRIES 3
+
+// Values not read for this long past their interval are reported as stale
+#define SBS_STALE_TIME 5000
+
+// Battery is under load when it delivers at least this many mA
+#define SBS_LOAD_CURRENT 1000
+
+struct SbsRegister {
+    uint8_t index;
+    // Range of valid values, reads outside of it are errors
+    int16_t min;
+    int16_t max;
+    uint16_t * value;
+    // Polling interval in ms, and while charging or under load if not 0
+    uint16_t interval;
+    uint16_t interval_load;
+};
+
+static const struct SbsRegister __code SBS_REGISTERS[] = {
+    // Status holds the alarms that stop charging. It is a bitfield, so all
+    // 16 bit values are valid, including OVER_CHARGED_ALARM in bit 15
+    { .index = 0x16, .min = INT16_MIN, .max = INT16_MAX, .value = &battery_status,
+      .interval = 1000 },
+    { .index = 0x09, .min = 5500, .max = 14000, .value = &battery_voltage,
+      .interval = 5000, .interval_load = 1000 },
+    { .index = 0x0a, .min = -15000, .max = 15000, .value = &battery_current,
+      .interval = 5000, .interval_load = 1000 },
+    { .index = 0x0d, .min = 0, .max = 100, .value = &battery_charge,
+      .interval = 5000 },
+    { .index = 0x0f, .min = 0, .max = 12000, .value = &battery_remaining_capacity,
+      .interval = 5000 },
+    // Temperature in 0.1 K, stored in 0.1 degrees C
+    { .index = 0x08, .min = 0x0000, .max = 0x7fff, .value = &battery_temp,
+      .interval = 5000 },
+    // Charge requests follow the charge state of the battery
+    { .index = 0x14, .min = 0, .max = 8000, .value = &battery_requested_current,
+      .interval = 5000, .interval_load = 2000 },
+    { .index = 0x15, .min = 0, .max = 14000, .value = &battery_requested_voltage,
+      .interval = 5000 },
+    // Also read on AC events, see board_battery_on_ac
+    { .index = 0x10, .min = 0, .max = 12000, .value = &battery_full_capacity,
+      .interval = 60000 },
+    { .index = 0x17, .min = 0x0000, .max = 0x7fff, .value = &battery_cycle_count,
+      .interval = 60000 },
+};
+
+#define SBS_REGISTERS_SIZE (sizeof(SBS_REGISTERS) / sizeof(SBS_REGISTERS[0]))
+
+struct SbsState {
+    // Time the register was last polled, successfully or not
+    uint32_t time;
+    // Time of the last good read, 0 if never read
+    uint32_t fresh;
+    // Failed reads of this poll
+    uint8_t errors;
+    // Poll at once
+    bool due;
+};
+
+static struct SbsState sbs_states[SBS_REGISTERS_SIZE];
+static uint8_t sbs_next = 0;
+
+// Battery is charging, or is discharged at a high rate
+static bool sbs_loaded(void)
 {
-int res;
-int16_t tval;
-
-    res = i2c_get_safe(0x16, &tval, 2, 0xffff, 0x7fff, 3);
-    if (res < 0) {
-        DEBUG(" 0x16 r=%d\n", res);
-    } else {
-        battery_status = tval;
-    }
+    int16_t current = (int16_t)battery_current;
 
-    res = i2c_get_safe(0x09, &tval, 2, 5500, 14000, 3);
-    if (res < 0) {
-        DEBUG(" 0x09 r=%d\n", res);
-    } else {
-        battery_voltage = tval;
-    }
+    if (battery_charger_is_enabled())
+        return true;
+    return (current <= -SBS_LOAD_CURRENT) || (current >= SBS_LOAD_CURRENT);
+}
 
-    res = i2c_get_safe(0x0a, &tval, 2, -15000, 15000, 3);
-    if (res < 0) {
-        DEBUG(" 0x0A r=%d\n", res);
-    } else {
-        battery_current = tval;
-    }
+static uint16_t sbs_interval(const struct SbsRegister * reg, bool loaded)
+{
+    if (loaded && reg->interval_load)
+        return reg->interval_load;
+    return reg->interval;
+}
 
-    res = i2c_get_safe(0x0d, &tval, 2, 0, 100, 3);
-    if (res < 0) {
-        DEBUG(" 0x0D r=%d\n", res);
-    } else {
-        battery_charge = tval;
-    }
+static void sbs_store(const struct SbsRegister * reg, int16_t tval)
+{
+    if (reg->index == 0x08)
+        tval -= 2731;
+    *reg->value = tval;
+}
 
-    res = i2c_get_safe(0x0f, &tval, 2, 0, 12000, 3);
-    if (res < 0) {
-        DEBUG(" 0x0F r=%d\n", res);
-    } else {
-        battery_remaining_capacity = tval;
-    }
+// Read all runtime registers at once, blocking, used when a battery is found
+static void update_gas_gauge(void)
+{
+int res;
+int16_t tval;
+uint8_t i;
 
-    res = i2c_get_safe(0x10, &tval, 2, 0, 12000, 3);
-    if (res < 0) {
-        DEBUG(" 0x10 r=%d\n", res);
-    } else {
-        battery_full_capacity = tval;
+    for (i = 0; i < SBS_REGISTERS_SIZE; i++) {
+        const struct SbsRegister * reg = &SBS_REGISTERS[i];
+        res = i2c_get_safe(reg->index, &tval, 2, reg->min, reg->max, SBS_TRIES);
+        if (res < 0) {
+            DEBUG(" 0x%02X r=%d\n", reg->index, res);
+        } else {
+            sbs_store(reg, tval);
+            sbs_states[i].fresh = time_get();
+        }
+        sbs_states[i].time = time_get();
+        sbs_states[i].errors = 0;
+        sbs_states[i].due = false;
     }
+}
 
-    res = i2c_get_safe(0x17, &tval, 2, 0x000, 0x7fff, 3);
-    if (res < 0) {
-        DEBUG(" 0x17 r=%d\n", res);
-    } else {
-        battery_cycle_count = tval;
-    }
+// Do at most one SBS transaction, for the next register that is due
+static void sbs_poll(void)
+{
+static uint32_t last_time = 0;
+uint32_t time = time_get();
+bool loaded;
+uint8_t i;
+
+    if (last_time <= time && (time - last_time) < SBS_SLOT_INTERVAL)
+        return;
+    last_time = time;
+
+    loaded = sbs_loaded();
+    for (i = 0; i < SBS_REGISTERS_SIZE; i++) {
+        uint8_t index = sbs_next;
+        const struct SbsRegister * reg = &SBS_REGISTERS[index];
+        struct SbsState * state = &sbs_states[index];
+        int16_t tval = -1;
+        int res;
 
-    res = i2c_get_safe(0x08, &tval, 2, 0x0000, 0x7fff, 3);
-    if (res < 0) {
-        DEBUG(" 0x08 r=%d\n", res);
-    } else {
-        battery_temp = (tval - 2731);
+        sbs_next = (sbs_next + 1) % SBS_REGISTERS_SIZE;
+
+        // Registers with a failed read are due at once
+        if (!state->due && state->errors == 0 &&
+            state->time <= time && (time - state->time) < sbs_interval(reg, loaded))
+            continue;
+
+        res = i2c_get(&I2C_0, BAT_GAS_GAUGE_ADDR, reg->index, (uint8_t *)&tval, 2);
+        if (res >= 0 && tval >= reg->min && tval <= reg->max) {
+            sbs_store(reg, tval);
+            state->fresh = time;
+            state->time = time;
+            state->errors = 0;
+            state->due = false;
+        } else if (++state->errors >= SBS_TRIES) {
+            DEBUG("sbs bat get 0x%02x giving up r=%d\n", reg->index, res);
+            state->time = time;
+            state->errors = 0;
+            state->due = false;
+        }
+        return;
     }
 }
 
@@ -389,7 +642,8 @@ int16_t tval;
 
     DEBUG("bat probe - ");
 
-    res = i2c_get_safe(0x03, &tval, 2, 0xffff, 0x7fff, 3);
+    // BatteryMode is a bitfield, any value is valid
+    res = i2c_get_safe(0x03, &tval, 2, INT16_MIN, INT16_MAX, 3);
     if (res < 0) {
         DEBUG("bat gauge r=%d\n", res);
         return false;
@@ -425,7 +679,7 @@ int16_t tval;
         battery_design_voltage = tval;
     }
 
-    res = i2c_get_safe(0x1b, &tval, 2, 0xffff, 0x7fff, 3);
+    res = i2c_get_safe(0x1b, &tval, 2, INT16_MIN, INT16_MAX, 3);
     if (res < 0) {
         DEBUG(" 0x1b r=%d\n", res);
     } else {
@@ -433,7 +687,7 @@ int16_t tval;
         battery_manufacturing_date = tval;
     }
 
-    res = i2c_get_safe(0x1c, &tval, 2, 0xffff, 0x7fff, 3);
+    res = i2c_get_safe(0x1c, &tval, 2, INT16_MIN, INT16_MAX, 3);
     if (res < 0) {
         DEBUG(" 0x1c r=%d\n", res);
     } else {
@@ -482,18 +736,170 @@ int16_t tval;
     return true;
 }
 
+// The adapter can not be identified, barrel and USB-PD adapters share ACIN
+// and there is no ADC on the adapter voltage. The input current limit is set
+// from the rating of the adapter at the 20 V of USB-PD, which is the lower
+// current of the two. The default is the 90 W adapter shipped with the
+// board. A smaller adapter drops out while loaded, so its rating is derated
+// until it is unplugged for good.
+#ifndef POWER_ADAPTER_WATTS
+    #define POWER_ADAPTER_WATTS 90
+#endif
+
+// Adapter voltage in mV
+#define ADAPTER_VOLTAGE 20000
+// Each overload derates the adapter by this many W, down to ADAPTER_WATTS_MIN
+#define ADAPTER_DERATE_WATTS 10
+#define ADAPTER_WATTS_MIN 30
+// AC back within this many ms of a loss is a drop out
+#define ADAPTER_DROP_TIME 3000
+// Adapter is loaded at this share of its input current limit, in %
+#define ADAPTER_LOADED 90
+// Share of the input current limit kept for load steps, in %
+#define ADAPTER_HEADROOM 10
+// Charge current while the system takes most of the adapter, so charging
+// does not stall, in mA
+#define ADAPTER_CHARGE_MIN 128
+// Charger efficiency in %
+#define CHARGER_EFFICIENCY 90
+
+static uint8_t adapter_watts = POWER_ADAPTER_WATTS;
+// Last measured adapter current in mA
+static uint16_t adapter_current = 0;
+static uint32_t adapter_lost_time = 0;
+static bool adapter_lost_loaded = false;
+
+static void adapter_set_watts(uint8_t watts)
+{
+    adapter_watts = watts;
+    charger_input_current = (uint16_t)(((uint32_t)watts * 1000000) / ADAPTER_VOLTAGE);
+    DEBUG("adapter %d W, input %d mA\n", watts, charger_input_current);
+}
+
+uint8_t board_adapter_watts(void)
+{
+    return adapter_watts;
+}
+
+// highest charge current that leaves the system its share of the adapter
+uint16_t board_battery_charge_limit(void)
+{
+uint32_t charge_input;
+int32_t available;
+uint32_t limit;
+
+    if (gpio_get(&ACIN_N) || battery_voltage == 0)
+        return 0xFFFF;
+
+    // adapter current taken by the charger at the current set, the rest is
+    // the system
+    charge_input = 0;
+    if (battery_charger_is_enabled())
+        charge_input = ((((uint32_t)battery_charge_current * battery_voltage) /
+            ADAPTER_VOLTAGE) * 100) / CHARGER_EFFICIENCY;
+
+    available = ((int32_t)charger_input_current * (100 - ADAPTER_HEADROOM)) / 100;
+    available -= (int32_t)adapter_current - (int32_t)charge_input;
+    if (available <= 0)
+        return ADAPTER_CHARGE_MIN;
+
+    limit = ((((uint32_t)available * ADAPTER_VOLTAGE) / battery_voltage) *
+        CHARGER_EFFICIENCY) / 100;
+    if (limit < ADAPTER_CHARGE_MIN)
+        return ADAPTER_CHARGE_MIN;
+    if (limit > 0xFFFF)
+        return 0xFFFF;
+    return (uint16_t)limit;
+}
+
+// charge current estimated from the adapter current, for batteries without a
+// gas gauge. The system shares the adapter current, so the estimate is the
+// charge current set, but no more than the whole adapter current gives at the
+// battery voltage.
+static uint16_t adapter_charge_current(uint16_t adapter)
+{
+uint32_t limit;
+
+    if (!battery_charger_is_enabled() || battery_voltage == 0)
+        return 0;
+
+    limit = ((((uint32_t)adapter * ADAPTER_VOLTAGE) / battery_voltage) *
+        CHARGER_EFFICIENCY) / 100;
+    if (limit < battery_charge_current)
+        return (uint16_t)limit;
+    return battery_charge_current;
+}
+
+// called every main loop cycle, reads the SBS battery in the background
+void board_battery_event(void)
+{
+    if (battery_present && sbs_battery)
+        sbs_poll();
+}
+
+// called when AC is plugged or unplugged, the battery changes from charging to
+// discharging so all registers are read again
+void board_battery_on_ac(bool ac)
+{
+    uint32_t time = time_get();
+    uint8_t i;
+
+    for (i = 0; i < SBS_REGISTERS_SIZE; i++)
+        sbs_states[i].due = true;
+
+    if (!ac) {
+        adapter_lost_time = time;
+        adapter_lost_loaded = (uint32_t)adapter_current * 100 >=
+            (uint32_t)charger_input_current * ADAPTER_LOADED;
+    } else if (adapter_lost_loaded && (time - adapter_lost_time) < ADAPTER_DROP_TIME) {
+        DEBUG("adapter dropped out at %d mA\n", adapter_current);
+        if (adapter_watts >= ADAPTER_WATTS_MIN + ADAPTER_DERATE_WATTS)
+            adapter_set_watts(adapter_watts - ADAPTER_DERATE_WATTS);
+    } else if (adapter_watts != POWER_ADAPTER_WATTS) {
+        // a new adapter, or the same one after a rest
+        adapter_set_watts(POWER_ADAPTER_WATTS);
+    }
+}
+
 void board_battery_update_state(void)
 {
     if (battery_status & BATTERY_INITIALIZED) {
-        if (sbs_battery)
-            update_gas_gauge();
-        else {
+        if (sbs_battery) {
+            uint32_t time = time_get();
+            bool loaded = sbs_loaded();
+            uint8_t i;
+
+            // values are updated by board_battery_event, report stale ones
+            for (i = 0; i < SBS_REGISTERS_SIZE; i++) {
+                uint32_t stale = (uint32_t)sbs_interval(&SBS_REGISTERS[i], loaded) + SBS_STALE_TIME;
+                if ((time - sbs_states[i].fresh) >= stale)
+                    DEBUG("sbs bat 0x%02x stale\n", SBS_REGISTERS[i].index);
+            }
+        } else {
             battery_voltage = board_battery_get_voltage();
             battery_current = board_battery_get_current();
             battery_charge = board_battery_get_charge();
         }
     }
-    board_get_current();
+    adapter_current = gpio_get(&ACIN_N) ? 0 : board_get_current();
+}
+
+int board_battery_get_string(uint8_t command, char * str, int size)
+{
+int res;
+
+    if (size < 2)
+        return -1;
+
+    // leave room for the NUL after the count byte is dropped
+    res = i2c_get_block(&I2C_0, BAT_GAS_GAUGE_ADDR, command, (uint8_t *)str, size - 1);
+    if (res < 0) {
+        str[0] = '\0';
+        return res;
+    }
+    str[res] = '\0';
+
+    return res;
 }
 
 void board_battery_print_batinfo(void)
@@ -517,6 +923,8 @@ void board_battery_print_batinfo(void)
 void board_battery_init(void)
 {
     int res=0;
+    // SBS strings are up to 20 characters, with the count byte or the NUL
+    char name[22];
 
     battery_voltage = 0;
     battery_temp = 0;
@@ -534,8 +942,7 @@ void board_battery_init(void)
     // charger voltage
     // 19V for barrel connector,
     // 20V for type-C PD
-    // charger_input_current = 3420; // max current of 65W charger
-    charger_input_current = 4700; // max current of 90W charger
+    adapter_set_watts(adapter_watts);
 
     battery_present = !gpio_get(&BAT_DETECT_N);
 
@@ -553,6 +960,10 @@ void board_battery_init(void)
         } else {
             if (probe_gas_gauge()) {
                 DEBUG("I: SBS bat found\n");
+                if (board_battery_get_string(BATTERY_MANUFACTURER_NAME, name, sizeof(name)) >= 0)
+                    DEBUG("  manuf:    %s\n", name);
+                if (board_battery_get_string(BATTERY_DEVICE_NAME, name, sizeof(name)) >= 0)
+                    DEBUG("  device:   %s\n", name);
                 update_gas_gauge();
 
                 board_battery_print_batinfo();
@@ -53,3 +53,41 @@ int i2c_set(struct I2C * i2c, uint8_t addr, uint8_t reg, uint8_t* data, int leng
 
     return i2c_send(i2c, addr, data, length);
 }
+
+int i2c_get_block(struct I2C * i2c, uint8_t addr, uint8_t reg, uint8_t* data, int length) __reentrant {
+    int res = 0;
+    int i;
+
+    // Every read ends by not acknowledging its last byte, so the count can not
+    // be read on its own. The whole buffer is read, the device pads the block.
+    res = i2c_get(i2c, addr, reg, data, length);
+    if (res < 0) return res;
+
+    // Block does not fit
+    res = data[0];
+    if (res >= length) return -1;
+
+    for (i = 0; i < res; i++) {
+        data[i] = data[i + 1];
+    }
+
+    return res;
+}
+
+int i2c_set_block(struct I2C * i2c, uint8_t addr, uint8_t reg, uint8_t* data, int length) __reentrant {
+    int res = 0;
+    uint8_t count = (uint8_t)length;
+
+    if (length > I2C_BLOCK_MAX) return -1;
+
+    res = i2c_start(i2c, addr, false);
+    if (res < 0) return res;
+
+    res = i2c_write(i2c, &reg, 1);
+    if (res < 0) return res;
+
+    res = i2c_write(i2c, &count, 1);
+    if (res < 0) return res;
+
+    return i2c_send(i2c, addr, data, length);
+}
@@ -42,6 +42,38 @@ enum Command {
     CMD_MATRIX_GET = 17,
     // Save LED settings to ROM
     CMD_LED_SAVE = 18,
+    // 19 was CMD_SPI_CRC, replaced by CMD_SPI_DIFF
+    // Write data to scratch ROM SPI sector buffer
+    CMD_SPI_BUFFER = 20,
+    // Erase, program, and verify SPI flash from scratch ROM sector buffer
+    CMD_SPI_PROGRAM = 21,
+    // Erase the update staging slot
+    CMD_UPDATE_BEGIN = 22,
+    // Write data to the update staging slot
+    CMD_UPDATE_WRITE = 23,
+    // Verify the staged update, marking it to be applied when the system is off
+    CMD_UPDATE_COMMIT = 24,
+    // Get state of the staged update
+    CMD_UPDATE_STATUS = 25,
+    // Copy the staged update over the running firmware, sent by the EC itself
+    CMD_UPDATE_APPLY = 26,
+    // Get what is keeping the EC from being safe to enter scratch ROM
+    CMD_BUSY_GET = 27,
+    // Compare SPI flash sectors against a manifest of CRC-32s, before
+    // entering scratch ROM
+    CMD_SPI_DIFF = 28,
+    // Get fan curve settings
+    CMD_FAN_CURVE_GET = 29,
+    // Set and save fan curve settings
+    CMD_FAN_CURVE_SET = 30,
+    // Get CPU package power and energy counter
+    CMD_POWER_GET = 31,
+    // Get a chunk of the battery history log
+    CMD_BATTERY_LOG_GET = 32,
+    // Set the battery history logging interval
+    CMD_BATTERY_LOG_SET = 33,
+    // Get smoothed battery power and time to empty and full
+    CMD_BATTERY_TIME_GET = 34,
     //TODO
 };
 
@@ -62,6 +94,54 @@ enum CommandSpiFlag {
     CMD_SPI_FLAG_SCRATCH = (1 << 2),
     // Write to backup ROM instead
     CMD_SPI_FLAG_BACKUP = (1 << 3),
+    // Erase sector before programming, for CMD_SPI_PROGRAM
+    CMD_SPI_FLAG_ERASE = (1 << 4),
+};
+
+enum CommandSpiProgramStatus {
+    // Sector programmed and verified
+    CMD_SPI_PROGRAM_OK = 0,
+    // Invalid target, address, or length
+    CMD_SPI_PROGRAM_PARAMETER = 1,
+    // Timed out erasing sector
+    CMD_SPI_PROGRAM_ERASE = 2,
+    // Timed out programming sector
+    CMD_SPI_PROGRAM_WRITE = 3,
+    // Sector does not match buffer after programming
+    CMD_SPI_PROGRAM_VERIFY = 4,
+};
+
+enum CommandUpdateState {
+    // No update staged
+    CMD_UPDATE_STATE_NONE = 0,
+    // Staging slot is being written
+    CMD_UPDATE_STATE_WRITING = 1,
+    // Staged image is being checked against its CRC-32
+    CMD_UPDATE_STATE_VERIFYING = 2,
+    // Staged image is valid and will be applied when the system is off
+    CMD_UPDATE_STATE_READY = 3,
+    // Staged image failed verification
+    CMD_UPDATE_STATE_ERROR = 4,
+};
+
+enum CommandBusyFlag {
+    // Keys are pressed
+    CMD_BUSY_FLAG_KEYS = (1 << 0),
+    // Keyboard controller has data or a command in progress
+    CMD_BUSY_FLAG_KBC = (1 << 1),
+    // Staged update is being written or verified
+    CMD_BUSY_FLAG_UPDATE = (1 << 2),
+};
+
+enum CommandProbeFlag {
+    // Board has headphone jack detect
+    CMD_PROBE_FLAG_JACK_DETECT = (1 << 0),
+    // EC is running from scratch ROM
+    CMD_PROBE_FLAG_SCRATCH = (1 << 1),
+    // Scratch ROM supports CMD_SPI_BUFFER and CMD_SPI_PROGRAM
+    CMD_PROBE_FLAG_SPI_PROGRAM = (1 << 3),
+    // Firmware supports CMD_SPI_DIFF, which is not available in scratch ROM
+    CMD_PROBE_FLAG_SPI_DIFF = (1 << 4),
 };
 
 #define CMD_LED_INDEX_ALL 0xFF
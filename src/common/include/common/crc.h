@@ -0,0 +1,12 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#ifndef _COMMON_CRC_H
+#define _COMMON_CRC_H
+
+#include <stdint.h>
+
+// Update a CRC-32 (IEEE 802.3) with one byte. Start with 0xFFFFFFFF and
+// invert the result when done.
+uint32_t crc32_update(uint32_t crc, uint8_t data);
+
+#endif // _COMMON_CRC_H
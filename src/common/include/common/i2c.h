@@ -11,6 +11,9 @@
     #define __reentrant
 #endif
 
+// Largest SMBus block, not counting the count byte
+#define I2C_BLOCK_MAX 32
+
 // I2C bus, should be defined elsewhere
 struct I2C;
 
@@ -42,4 +45,12 @@ int i2c_get(struct I2C * i2c, uint8_t addr, uint8_t reg, uint8_t* data, int leng
 // Write multiple bytes to a register in one transaction
 int i2c_set(struct I2C * i2c, uint8_t addr, uint8_t reg, uint8_t* data, int length) __reentrant;
 
+// Read an SMBus block from a register, length includes the count byte, so the
+// block can hold up to length - 1 bytes. Returns the size of the block, which
+// is moved to the start of data
+int i2c_get_block(struct I2C * i2c, uint8_t addr, uint8_t reg, uint8_t* data, int length) __reentrant;
+
+// Write an SMBus block of up to I2C_BLOCK_MAX bytes to a register
+int i2c_set_block(struct I2C * i2c, uint8_t addr, uint8_t reg, uint8_t* data, int length) __reentrant;
+
 #endif // _COMMON_I2C_H
@@ -26,6 +26,10 @@
     bool keymap_load_config(void);
     // Save dynamic keymap to flash
     bool keymap_save_config(void);
+    // Test if dynamic keymap is saved in flash
+    bool keymap_config_valid(void);
+    // Write dynamic keymap to erased flash
+    bool keymap_write_config(void);
     // Get a keycode from the dynamic keymap
     bool keymap_get(int layer, int output, int input, uint16_t * value);
     // Set a keycode in the dynamic keymap
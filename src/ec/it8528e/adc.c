@@ -30,3 +30,100 @@ void adc_init(void) {
 //    adc_enable(false);
 }
 
+
+// Each filtered update sums 1 << ADC_FRACTION_BITS samples, which is their
+// average with ADC_FRACTION_BITS of fraction
+#define ADC_OVERSAMPLE (1 << ADC_FRACTION_BITS)
+// Weight of each update in the filtered value, 1 / (1 << ADC_FILTER_SHIFT)
+#define ADC_FILTER_SHIFT 1
+
+struct AdcChannel {
+    // Sum of the samples of the update in progress
+    uint16_t sum;
+    uint8_t samples;
+    // Filtered value, 0 until the first update
+    uint16_t value;
+    bool ready;
+};
+
+static struct AdcChannel adc_channels[ADC_CHANNELS] = { 0 };
+
+// Take a finished conversion of a channel and start the next one, returns
+// false if the conversion is not done yet
+static bool adc_sample(uint8_t channel, uint16_t * sample) {
+    volatile uint8_t __xdata * ctl;
+    uint8_t high;
+    uint8_t low;
+
+    switch (channel) {
+        case 0:
+            ctl = &VCH0CTL;
+            if (!(*ctl & (1 << 7))) return false;
+            high = VCH0DATM;
+            low = VCH0DATL;
+            break;
+        case 1:
+            ctl = &VCH1CTL;
+            if (!(*ctl & (1 << 7))) return false;
+            high = VCH1DATM;
+            low = VCH1DATL;
+            break;
+        case 2:
+            ctl = &VCH2CTL;
+            if (!(*ctl & (1 << 7))) return false;
+            high = VCH2DATM;
+            low = VCH2DATL;
+            break;
+        case 3:
+            ctl = &VCH3CTL;
+            if (!(*ctl & (1 << 7))) return false;
+            high = VCH3DATM;
+            low = VCH3DATL;
+            break;
+        default:
+            return false;
+    }
+
+    *sample = (((uint16_t)high & 0x03) << 8) | low;
+
+    // Clear data valid to start a new conversion
+    *ctl |= (1 << 7);
+    return true;
+}
+
+// Collect finished conversions, called every main loop cycle
+void adc_event(void) {
+    for (uint8_t i = 0; i < ADC_CHANNELS; i++) {
+        struct AdcChannel * channel = &adc_channels[i];
+        uint16_t sample;
+
+        if (!adc_sample(i, &sample)) continue;
+
+        channel->sum += sample;
+        if (++channel->samples < ADC_OVERSAMPLE) continue;
+
+        uint16_t average = channel->sum;
+        channel->sum = 0;
+        channel->samples = 0;
+
+        if (channel->ready) {
+            int16_t delta = (int16_t)average - (int16_t)channel->value;
+            channel->value += delta >> ADC_FILTER_SHIFT;
+        } else {
+            channel->value = average;
+            channel->ready = true;
+        }
+    }
+}
+
+// True once a channel has a filtered value
+bool adc_ready(uint8_t channel) {
+    if (channel >= ADC_CHANNELS) return false;
+    return adc_channels[channel].ready;
+}
+
+// Filtered value of a channel, up to ADC_MAX
+uint16_t adc_get(uint8_t channel) {
+    if (channel >= ADC_CHANNELS) return 0;
+    return adc_channels[channel].value;
+}
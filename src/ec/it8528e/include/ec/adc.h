@@ -3,8 +3,18 @@
 #ifndef _EC_ADC_H
 #define _EC_ADC_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+// Channels kept converting by adc_event, from VCH0
+#ifndef ADC_CHANNELS
+    #define ADC_CHANNELS 3
+#endif
+
+// Filtered values are 10-bit samples with ADC_FRACTION_BITS of fraction
+#define ADC_FRACTION_BITS 4
+#define ADC_MAX (0x3FFU << ADC_FRACTION_BITS)
+
 volatile uint8_t __xdata __at(0x1900) ADCSTS;
 volatile uint8_t __xdata __at(0x1901) ADCCFG;
 volatile uint8_t __xdata __at(0x1902) ADCCTL;
@@ -51,5 +61,8 @@ volatile uint8_t __xdata __at(0x1952) VCMPLR;
 
 void adc_enable(bool enable);
 void adc_init(void);
+void adc_event(void);
+bool adc_ready(uint8_t channel);
+uint16_t adc_get(uint8_t channel);
 
 #endif // _EC_ADC_H
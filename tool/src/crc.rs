@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: MIT
+
+/// Update a CRC-32 (IEEE 802.3), matching the EC implementation
+pub fn crc32_update(mut crc: u32, data: &[u8]) -> u32 {
+    for &byte in data.iter() {
+        crc ^= byte as u32;
+        for _ in 0..8 {
+            crc = (crc >> 1) ^ (0xEDB8_8320 & (!(crc & 1)).wrapping_add(1));
+        }
+    }
+    crc
+}
+
+/// Calculate a CRC-32 (IEEE 802.3), matching the EC implementation
+pub fn crc32(data: &[u8]) -> u32 {
+    !crc32_update(0xFFFF_FFFF, data)
+}
@@ -4,6 +4,7 @@
 use alloc::{
     boxed::Box,
     vec,
+    vec::Vec,
 };
 
 use crate::{
@@ -35,12 +36,110 @@ enum Cmd {
     LedSetMode = 16,
     MatrixGet = 17,
     LedSave = 18,
+    // SpiCrc = 19, replaced by SpiDiff
+    SpiBuffer = 20,
+    SpiProgram = 21,
+    UpdateBegin = 22,
+    UpdateWrite = 23,
+    UpdateCommit = 24,
+    UpdateStatus = 25,
+    // UpdateApply = 26, only sent by the EC itself
+    BusyGet = 27,
+    SpiDiff = 28,
+    FanCurveGet = 29,
+    FanCurveSet = 30,
+    PowerGet = 31,
+    BatteryLogGet = 32,
+    BatteryLogSet = 33,
+    BatteryTimeGet = 34,
 }
 
 const CMD_SPI_FLAG_READ: u8 = 1 << 0;
 const CMD_SPI_FLAG_DISABLE: u8 = 1 << 1;
 const CMD_SPI_FLAG_SCRATCH: u8 = 1 << 2;
 const CMD_SPI_FLAG_BACKUP: u8 = 1 << 3;
+const CMD_SPI_FLAG_ERASE: u8 = 1 << 4;
+
+const CMD_PROBE_FLAG_SCRATCH: u8 = 1 << 1;
+const CMD_PROBE_FLAG_SPI_PROGRAM: u8 = 1 << 3;
+const CMD_PROBE_FLAG_SPI_DIFF: u8 = 1 << 4;
+
+// Limit bytes hashed by one command, to stay well inside the command timeout
+const SPI_DIFF_BYTES_MAX: usize = 2048;
+
+// Size of the scratch ROM sector buffer used by CMD_SPI_PROGRAM
+const SPI_PROGRAM_BUFFER_SIZE: usize = 1024;
+
+// Limit update data per command, the EC programs it a slice at a time
+const UPDATE_WRITE_BYTES_MAX: usize = 128;
+
+/// State of a staged firmware update
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub enum UpdateState {
+    /// No update staged
+    None,
+    /// Staging slot is being written
+    Writing,
+    /// Staged image is being checked against its CRC-32
+    Verifying,
+    /// Staged image is valid and will be applied when the system is off
+    Ready,
+    /// Staged image failed verification, or failed to apply
+    Error,
+}
+
+/// Most points in a fan curve
+pub const FAN_CURVE_POINTS_MAX: usize = 16;
+
+/// Temperature a fan follows
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+#[repr(u8)]
+pub enum FanSource {
+    /// CPU temperature from PECI
+    Peci = 0,
+    /// Battery temperature from the gas gauge
+    Battery = 1,
+    /// Board thermistor
+    Thermistor = 2,
+}
+
+/// Fan curve settings, saved by the EC
+#[derive(Clone, Debug, Eq, PartialEq)]
+pub struct FanCurve {
+    /// Seconds the fan has to be requested faster before it speeds up
+    pub heatup: u8,
+    /// Seconds the fan keeps its speed before it slows down
+    pub cooldown: u8,
+    /// Interpolate duty between points
+    pub interpolate: bool,
+    /// Temperature source
+    pub source: FanSource,
+    /// Temperature in degrees C and duty in percent of each point
+    pub points: Vec<(u8, u8)>,
+}
+
+/// Battery reading logged by the EC
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub struct BatterySample {
+    /// Seconds since the EC started
+    pub time: u32,
+    /// Voltage in mV, in steps of 64 mV
+    pub voltage: u16,
+    /// Current in mA, in steps of 64 mA, negative when discharging
+    pub current: i16,
+    /// Temperature in 0.1 degrees C, in whole degrees
+    pub temp: i16,
+    /// SBS battery status, only the alarms in bits 11 to 15
+    pub status: u16,
+    /// Relative state of charge in percent
+    pub charge: u8,
+    /// State of the EC charge profile
+    pub charge_state: u8,
+}
+
+// Bytes before the samples in a battery log response, and bytes per sample
+const BATTERY_LOG_HEADER: usize = 11;
+const BATTERY_LOG_SAMPLE: usize = 14;
 
 /// Run EC commands using a provided access method
 pub struct Ec<A: Access> {
@@ -94,6 +193,55 @@ impl<A: Access> Ec<A> {
         }
     }
 
+    /// Read feature flags from probe
+    unsafe fn probe_flags(&mut self) -> Result<u8, Error> {
+        let mut data = [0; 4];
+        self.command(Cmd::Probe, &mut data)?;
+        Ok(data[3])
+    }
+
+    /// Compare main ROM sectors of `sector_size` bytes starting at `address`
+    /// with the CRC-32s in `crcs`, setting `changed` for sectors that differ.
+    /// The running firmware does this, so it has to be done before entering
+    /// scratch ROM
+    pub unsafe fn spi_diff(&mut self, address: u32, sector_size: usize, crcs: &[u32], changed: &mut [bool]) -> Result<(), Error> {
+        if self.probe_flags()? & CMD_PROBE_FLAG_SPI_DIFF == 0 {
+            return Err(Error::NotSupported);
+        }
+        if sector_size == 0 || sector_size > 0xFFFF || changed.len() < crcs.len() {
+            return Err(Error::Parameter);
+        }
+
+        let data_size = self.access.data_size();
+        let mut i = 0;
+        while i < crcs.len() {
+            let count = (crcs.len() - i)
+                .min((data_size - 8) / 4)
+                .min((SPI_DIFF_BYTES_MAX / sector_size).max(1))
+                .min(255);
+
+            let sector_address = address + (i * sector_size) as u32;
+            let mut data = vec![0; 8 + count * 4];
+            data[0] = 0;
+            data[1] = count as u8;
+            data[2..6].copy_from_slice(&sector_address.to_le_bytes());
+            data[6..8].copy_from_slice(&(sector_size as u16).to_le_bytes());
+            for j in 0..count {
+                data[(8 + j * 4)..(12 + j * 4)].copy_from_slice(&crcs[i + j].to_le_bytes());
+            }
+            self.command(Cmd::SpiDiff, &mut data)?;
+            if data[1] as usize != count {
+                return Err(Error::Verify);
+            }
+            for j in 0..count {
+                changed[i + j] = data[8 + j / 8] & (1 << (j % 8)) != 0;
+            }
+            i += count;
+        }
+
+        Ok(())
+    }
+
     /// Read board from EC
     pub unsafe fn board(&mut self, data: &mut [u8]) -> Result<usize, Error> {
         self.command(Cmd::Board, data)?;
@@ -146,9 +294,14 @@ impl<A: Access> Ec<A> {
             ec: self,
             target,
             scratch,
+            scratch_flags: 0,
             buffer: vec![0; data_size].into_boxed_slice(),
         };
         spi.reset()?;
+        if scratch {
+            // Scratch ROM is now running, check which features it supports
+            spi.scratch_flags = spi.scratch_probe()?;
+        }
         Ok(spi)
     }
 
@@ -176,6 +329,124 @@ impl<A: Access> Ec<A> {
         self.command(Cmd::FanSet, &mut data)
     }
 
+    /// Read fan curve settings by fan index
+    pub unsafe fn fan_curve_get(&mut self, index: u8) -> Result<FanCurve, Error> {
+        let mut data = [0; 6 + FAN_CURVE_POINTS_MAX * 2];
+        data[0] = index;
+        self.command(Cmd::FanCurveGet, &mut data)?;
+
+        let source = match data[4] {
+            0 => FanSource::Peci,
+            1 => FanSource::Battery,
+            2 => FanSource::Thermistor,
+            _ => return Err(Error::Verify),
+        };
+        let count = data[5] as usize;
+        if count > FAN_CURVE_POINTS_MAX {
+            return Err(Error::DataLength(count));
+        }
+        let points = data[6..(6 + count * 2)]
+            .chunks(2)
+            .map(|point| (point[0], point[1]))
+            .collect();
+        Ok(FanCurve {
+            heatup: data[1],
+            cooldown: data[2],
+            interpolate: data[3] != 0,
+            source,
+            points,
+        })
+    }
+
+    /// Set and save fan curve settings by fan index. The EC rejects settings
+    /// it cannot apply.
+    pub unsafe fn fan_curve_set(&mut self, index: u8, curve: &FanCurve) -> Result<(), Error> {
+        let count = curve.points.len();
+        if count == 0 || count > FAN_CURVE_POINTS_MAX {
+            return Err(Error::DataLength(count));
+        }
+
+        let mut data = [0; 6 + FAN_CURVE_POINTS_MAX * 2];
+        data[0] = index;
+        data[1] = curve.heatup;
+        data[2] = curve.cooldown;
+        data[3] = curve.interpolate as u8;
+        data[4] = curve.source as u8;
+        data[5] = count as u8;
+        for (i, (temp, duty)) in curve.points.iter().enumerate() {
+            data[6 + i * 2] = *temp;
+            data[7 + i * 2] = *duty;
+        }
+        self.command(Cmd::FanCurveSet, &mut data[..(6 + count * 2)])
+    }
+
+    /// Read CPU package power in mW, averaged by the EC, with the raw package
+    /// energy counter and its unit as a power of two fraction of a joule
+    pub unsafe fn power_get(&mut self) -> Result<(u32, u32, u8), Error> {
+        let mut data = [0; 9];
+        self.command(Cmd::PowerGet, &mut data)?;
+        let power = u32::from_le_bytes([data[0], data[1], data[2], data[3]]);
+        let energy = u32::from_le_bytes([data[4], data[5], data[6], data[7]]);
+        Ok((power, energy, data[8]))
+    }
+
+    /// Read the battery log, oldest sample first, with the logging interval
+    /// in seconds
+    pub unsafe fn battery_log_get(&mut self) -> Result<(Vec<BatterySample>, u16), Error> {
+        let count = (self.access.data_size() - BATTERY_LOG_HEADER) / BATTERY_LOG_SAMPLE;
+        let mut samples = Vec::new();
+        let mut seq: u32 = 0;
+        loop {
+            // Starts at the oldest sample if seq has been overwritten
+            let mut data = vec![0; BATTERY_LOG_HEADER + count * BATTERY_LOG_SAMPLE];
+            data[..4].copy_from_slice(&seq.to_le_bytes());
+            data[10] = count as u8;
+            self.command(Cmd::BatteryLogGet, &mut data)?;
+            let first = u32::from_le_bytes([data[0], data[1], data[2], data[3]]);
+            let next = u32::from_le_bytes([data[4], data[5], data[6], data[7]]);
+            let interval = u16::from_le_bytes([data[8], data[9]]);
+            let returned = data[10] as usize;
+            if returned > count {
+                return Err(Error::Verify);
+            }
+
+            for chunk in data[BATTERY_LOG_HEADER..].chunks(BATTERY_LOG_SAMPLE).take(returned) {
+                samples.push(BatterySample {
+                    time: u32::from_le_bytes([chunk[0], chunk[1], chunk[2], chunk[3]]),
+                    voltage: u16::from_le_bytes([chunk[4], chunk[5]]),
+                    current: i16::from_le_bytes([chunk[6], chunk[7]]),
+                    temp: i16::from_le_bytes([chunk[8], chunk[9]]),
+                    status: u16::from_le_bytes([chunk[10], chunk[11]]),
+                    charge: chunk[12],
+                    charge_state: chunk[13],
+                });
+            }
+
+            seq = first + returned as u32;
+            if returned == 0 || seq >= next {
+                return Ok((samples, interval));
+            }
+        }
+    }
+
+    /// Set seconds between battery log samples, zero stops logging
+    pub unsafe fn battery_log_set(&mut self, interval: u16) -> Result<(), Error> {
+        let mut data = interval.to_le_bytes();
+        self.command(Cmd::BatteryLogSet, &mut data)
+    }
+
+    /// Read battery power in mW smoothed by the EC, whether it is charging,
+    /// and the estimated minutes until empty and until full, if known
+    pub unsafe fn battery_time_get(&mut self) -> Result<(u32, bool, Option<u16>, Option<u16>), Error> {
+        let mut data = [0; 9];
+        self.command(Cmd::BatteryTimeGet, &mut data)?;
+        let power = u32::from_le_bytes([data[0], data[1], data[2], data[3]]);
+        let minutes = |value: u16| if value == 0xFFFF { None } else { Some(value) };
+        let empty = minutes(u16::from_le_bytes([data[5], data[6]]));
+        let full = minutes(u16::from_le_bytes([data[7], data[8]]));
+        Ok((power, data[4] != 0, empty, full))
+    }
+
     /// Read keymap data by layout, output pin, and input pin
     pub unsafe fn keymap_get(&mut self, layer: u8, output: u8, input: u8) -> Result<u16, Error> {
         let mut data = [
@@ -281,6 +552,55 @@ impl<A: Access> Ec<A> {
         self.command(Cmd::MatrixGet, matrix)
     }
 
+    /// Get flags for what keeps the EC from entering scratch ROM, zero when it is safe
+    pub unsafe fn busy_get(&mut self) -> Result<u8, Error> {
+        let mut data = [0; 1];
+        self.command(Cmd::BusyGet, &mut data)?;
+        Ok(data[0])
+    }
+
+    /// Erase the update staging slot, forgetting any staged update
+    pub unsafe fn update_begin(&mut self) -> Result<(), Error> {
+        self.command(Cmd::UpdateBegin, &mut [])
+    }
+
+    /// Write update data to the staging slot, which must be done in order
+    pub unsafe fn update_write(&mut self, offset: u32, data: &[u8]) -> Result<usize, Error> {
+        let flags = 0;
+        for (i, chunk) in data.chunks(UPDATE_WRITE_BYTES_MAX).enumerate() {
+            let chunk_offset = offset + (i * UPDATE_WRITE_BYTES_MAX) as u32;
+            let mut data = [0; UPDATE_WRITE_BYTES_MAX + 6];
+            data[0] = flags;
+            data[1] = chunk.len() as u8;
+            data[2..6].copy_from_slice(&chunk_offset.to_le_bytes());
+            data[6..(chunk.len() + 6)].copy_from_slice(chunk);
+            self.command(Cmd::UpdateWrite, &mut data[..(chunk.len() + 6)])?;
+        }
+        Ok(data.len())
+    }
+
+    /// Start verification of the staged update, poll `update_status` for the result
+    pub unsafe fn update_commit(&mut self, size: u32, crc: u32) -> Result<(), Error> {
+        let mut data = [0; 8];
+        data[..4].copy_from_slice(&size.to_le_bytes());
+        data[4..].copy_from_slice(&crc.to_le_bytes());
+        self.command(Cmd::UpdateCommit, &mut data)
+    }
+
+    /// Get state of the staged update
+    pub unsafe fn update_status(&mut self) -> Result<UpdateState, Error> {
+        let mut data = [0; 1];
+        self.command(Cmd::UpdateStatus, &mut data)?;
+        match data[0] {
+            0 => Ok(UpdateState::None),
+            1 => Ok(UpdateState::Writing),
+            2 => Ok(UpdateState::Verifying),
+            3 => Ok(UpdateState::Ready),
+            4 => Ok(UpdateState::Error),
+            _ => Err(Error::Verify),
+        }
+    }
+
     pub fn into_dyn(self) -> Ec<Box<dyn Access>>
     where A: 'static {
         Ec {
@@ -295,10 +615,26 @@ pub struct EcSpi<'a, A: Access> {
     ec: &'a mut Ec<A>,
     target: SpiTarget,
     scratch: bool,
+    scratch_flags: u8,
     buffer: Box<[u8]>,
 }
 
 impl<'a, A: Access> EcSpi<'a, A> {
+    /// Read scratch ROM feature flags. Older scratch ROMs do not respond to
+    /// probe, and have no optional features
+    unsafe fn scratch_probe(&mut self) -> Result<u8, Error> {
+        let mut data = [0; 4];
+        match self.ec.command(Cmd::Probe, &mut data) {
+            Ok(()) => if data[3] & CMD_PROBE_FLAG_SCRATCH != 0 {
+                Ok(data[3])
+            } else {
+                Ok(0)
+            },
+            Err(Error::Protocol(_)) => Ok(0),
+            Err(err) => Err(err),
+        }
+    }
+
     fn flags(&self, read: bool, disable: bool) -> u8 {
         let mut flags = 0;
 
@@ -375,6 +711,50 @@ impl<'a, A: Access> Spi for EcSpi<'a, A> {
         }
         Ok(data.len())
     }
+
+    /// SPI sector program, buffered, programmed and verified by the scratch ROM
+    unsafe fn program_sector(&mut self, address: u32, data: &[u8], erase: bool) -> Result<usize, Error> {
+        if self.scratch_flags & CMD_PROBE_FLAG_SPI_PROGRAM == 0 {
+            return Err(Error::NotSupported);
+        }
+        match self.target {
+            SpiTarget::Main => (),
+            SpiTarget::Backup => return Err(Error::NotSupported),
+        }
+        // Scratch ROM programs from 256 byte page boundaries
+        if address % 256 != 0 || data.len() > SPI_PROGRAM_BUFFER_SIZE || data.len() % 2 != 0 {
+            return Err(Error::Parameter);
+        }
+
+        // Upload sector to buffer
+        let chunk_size = self.buffer.len() - 4;
+        for (i, chunk) in data.chunks(chunk_size).enumerate() {
+            let offset = i * chunk_size;
+            self.buffer[0] = 0;
+            self.buffer[1] = chunk.len() as u8;
+            self.buffer[2..4].copy_from_slice(&(offset as u16).to_le_bytes());
+            self.buffer[4..(chunk.len() + 4)].copy_from_slice(chunk);
+            self.ec.command(Cmd::SpiBuffer, &mut self.buffer[..(chunk.len() + 4)])?;
+            if self.buffer[1] != chunk.len() as u8 {
+                return Err(Error::Verify);
+            }
+        }
+
+        // Erase, program, and verify
+        let mut flags = self.flags(false, true);
+        if erase {
+            flags |= CMD_SPI_FLAG_ERASE;
+        }
+        self.buffer[0] = flags;
+        self.buffer[1] = 0;
+        self.buffer[2..6].copy_from_slice(&address.to_le_bytes());
+        self.buffer[6..8].copy_from_slice(&(data.len() as u16).to_le_bytes());
+        match self.ec.command(Cmd::SpiProgram, &mut self.buffer[..8]) {
+            Ok(()) => Ok(data.len()),
+            Err(Error::Protocol(_)) => Err(Error::SpiProgram(self.buffer[1])),
+            Err(err) => Err(err),
+        }
+    }
 }
 
 impl<'a, A: Access> Drop for EcSpi<'a, A> {
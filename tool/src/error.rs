@@ -13,6 +13,8 @@ pub enum Error {
     Protocol(u8),
     /// EC protocol signature did not match
     Signature((u8, u8)),
+    /// Scratch ROM failed to program SPI flash, with the stage that failed
+    SpiProgram(u8),
     /// Super I/O ID did not match
     SuperIoId(u16),
     /// Blocking operation timed out
@@ -22,7 +22,10 @@ extern crate alloc;
 pub use self::access::*;
 mod access;
 
-pub use self::ec::Ec;
+pub use self::crc::crc32;
+mod crc;
+
+pub use self::ec::{BatterySample, Ec, FanCurve, FanSource, UpdateState, FAN_CURVE_POINTS_MAX};
 mod ec;
 
 pub use self::error::Error;
@@ -2,28 +2,37 @@
 
 use clap::{Arg, App, AppSettings, SubCommand};
 use ectool::{
+    crc32,
     Access,
     AccessHid,
     AccessLpcLinux,
     AccessLpcSim,
+    BatterySample,
     Ec,
     Error,
+    FanCurve,
+    FanSource,
     Firmware,
     StdTimeout,
     Spi,
     SpiRom,
     SpiTarget,
+    UpdateState,
 };
 use hidapi::HidApi;
 use std::{
+    cmp,
     fmt::Display,
     fs,
     process,
     str::{self, FromStr},
-    time::Duration,
+    time::{Duration, Instant},
     thread,
 };
 
+// Size of the EC update staging slot
+const UPDATE_SLOT_SIZE: usize = 0xF800;
+
 unsafe fn console(ec: &mut Ec<Box<dyn Access>>) -> Result<(), Error> {
     //TODO: driver support for reading debug region?
     let access = ec.access();
@@ -60,6 +69,43 @@ unsafe fn flash_read<S: Spi>(spi: &mut SpiRom<S, StdTimeout>, rom: &mut [u8], se
     Ok(())
 }
 
+// Read only the sectors marked in `sectors`
+unsafe fn flash_read_sectors<S: Spi>(spi: &mut SpiRom<S, StdTimeout>, rom: &mut [u8], sector_size: usize, sectors: &[bool]) -> Result<(), Error> {
+    for (sector, &read) in sectors.iter().enumerate() {
+        if ! read {
+            continue;
+        }
+
+        let address = sector * sector_size;
+        let next_address = address + sector_size;
+        eprint!("\rSPI Read {}K", address / 1024);
+        let count = spi.read_at(address as u32, &mut rom[address..next_address])?;
+        if count != sector_size {
+            eprintln!("\ncount {} did not match sector size {}", count, sector_size);
+            return Err(Error::Verify);
+        }
+    }
+    eprintln!("\rSPI Read {}K", rom.len() / 1024);
+    Ok(())
+}
+
+// Find sectors that do not match new_rom, by sending a manifest of sector
+// CRCs to the running firmware. Only the main ROM can be compared.
+unsafe fn flash_diff(ec: &mut Ec<Box<dyn Access>>, new_rom: &[u8], target: SpiTarget) -> Result<Vec<bool>, Error> {
+    match target {
+        SpiTarget::Main => (),
+        SpiTarget::Backup => return Err(Error::NotSupported),
+    }
+
+    let sector_size = target.sector_size();
+    let manifest: Vec<u32> = new_rom.chunks(sector_size).map(crc32).collect();
+
+    let mut changed = vec![false; manifest.len()];
+    ec.spi_diff(0, sector_size, &manifest, &mut changed)?;
+    eprintln!("SPI Diff {}K: {} sectors changed", new_rom.len() / 1024, changed.iter().filter(|&&x| x).count());
+    Ok(changed)
+}
+
 unsafe fn flash_inner(ec: &mut Ec<Box<dyn Access>>, firmware: &Firmware, target: SpiTarget, scratch: bool) -> Result<(), Error> {
     let rom_size = 128 * 1024;
 
@@ -68,6 +114,15 @@ unsafe fn flash_inner(ec: &mut Ec<Box<dyn Access>>, firmware: &Firmware, target:
         new_rom.push(0xFF);
     }
 
+    // If the firmware can hash flash, only sectors that differ need to be read
+    // back. The others already match the new ROM. This has to be done before
+    // the scratch ROM takes over.
+    let changed = match flash_diff(ec, &new_rom, target) {
+        Ok(changed) => Some(changed),
+        Err(Error::NotSupported) => None,
+        Err(err) => return Err(err),
+    };
+
     let mut spi_bus = ec.spi(target, scratch)?;
     let mut spi = SpiRom::new(
         &mut spi_bus,
@@ -76,7 +131,19 @@ unsafe fn flash_inner(ec: &mut Ec<Box<dyn Access>>, firmware: &Firmware, target:
     let sector_size = spi.sector_size();
 
     let mut rom = vec![0xFF; rom_size];
-    flash_read(&mut spi, &mut rom, sector_size)?;
+    match &changed {
+        Some(changed) => {
+            for (sector, &sector_changed) in changed.iter().enumerate() {
+                if ! sector_changed {
+                    let address = sector * sector_size;
+                    let next_address = address + sector_size;
+                    rom[address..next_address].copy_from_slice(&new_rom[address..next_address]);
+                }
+            }
+            flash_read_sectors(&mut spi, &mut rom, sector_size, changed)?;
+        },
+        None => flash_read(&mut spi, &mut rom, sector_size)?,
+    }
 
     eprintln!("Saving ROM to backup.rom");
     fs::write("backup.rom", &rom).map_err(|_| Error::Verify)?;
@@ -106,15 +173,31 @@ unsafe fn flash_inner(ec: &mut Ec<Box<dyn Access>>, firmware: &Firmware, target:
             }
 
             if ! matches {
-                if ! erased {
-                    spi.erase_sector(address as u32)?;
-                }
-                if ! new_erased {
-                    let count = spi.write_at(address as u32, &new_rom[address..next_address])?;
-                    if count != sector_size {
-                        eprintln!("\nWrite count {} did not match sector size {}", count, sector_size);
+                // Program whole sector on the EC if supported, an erased
+                // sector only needs the erase
+                let data = if new_erased {
+                    &new_rom[address..address]
+                } else {
+                    &new_rom[address..next_address]
+                };
+                match spi.program_sector(address as u32, data, ! erased) {
+                    Ok(count) => if count != data.len() {
+                        eprintln!("\nProgram count {} did not match sector size {}", count, data.len());
                         return Err(Error::Verify);
-                    }
+                    },
+                    Err(Error::NotSupported) => {
+                        if ! erased {
+                            spi.erase_sector(address as u32)?;
+                        }
+                        if ! new_erased {
+                            let count = spi.write_at(address as u32, data)?;
+                            if count != sector_size {
+                                eprintln!("\nWrite count {} did not match sector size {}", count, sector_size);
+                                return Err(Error::Verify);
+                            }
+                        }
+                    },
+                    Err(err) => return Err(err),
                 }
             }
 
@@ -122,12 +205,22 @@ unsafe fn flash_inner(ec: &mut Ec<Box<dyn Access>>, firmware: &Firmware, target:
         }
         eprintln!("\rSPI Write {}K", address / 1024);
 
-        // Verify chip write
-        flash_read(&mut spi, &mut rom, sector_size)?;
-        for i in 0..rom.len() {
-            if rom[i] != new_rom[i] {
-                eprintln!("Failed to program: {:X} is {:X} instead of {:X}", i, rom[i], new_rom[i]);
-                return Err(Error::Verify);
+        // Verify chip write, only sectors that changed can differ
+        if let Some(changed) = &changed {
+            flash_read_sectors(&mut spi, &mut rom, sector_size, changed)?;
+            for i in 0..rom.len() {
+                if rom[i] != new_rom[i] {
+                    eprintln!("Failed to program: {:X} is {:X} instead of {:X}", i, rom[i], new_rom[i]);
+                    return Err(Error::Verify);
+                }
+            }
+        } else {
+            flash_read(&mut spi, &mut rom, sector_size)?;
+            for i in 0..rom.len() {
+                if rom[i] != new_rom[i] {
+                    eprintln!("Failed to program: {:X} is {:X} instead of {:X}", i, rom[i], new_rom[i]);
+                    return Err(Error::Verify);
+                }
             }
         }
     }
@@ -137,12 +230,34 @@ unsafe fn flash_inner(ec: &mut Ec<Box<dyn Access>>, firmware: &Firmware, target:
     Ok(())
 }
 
-unsafe fn flash(ec: &mut Ec<Box<dyn Access>>, path: &str, target: SpiTarget) -> Result<(), Error> {
-    let scratch = true;
+unsafe fn wait_quiesced(ec: &mut Ec<Box<dyn Access>>, timeout: Duration) -> Result<(), Error> {
+    let data_size = ec.access().data_size();
+    let start = Instant::now();
+    loop {
+        let mut data = vec![0; data_size];
+        ec.matrix_get(&mut data)?;
+        let rows = *data.get(0).unwrap_or(&0) as usize;
+        let cols = *data.get(1).unwrap_or(&0) as usize;
+        let bytes = cmp::min((rows * cols + 7) / 8, data.len().saturating_sub(2));
+        let pressed = data[2..(bytes + 2)].iter().any(|&b| b != 0);
+
+        if !pressed {
+            // Older firmware only reports the matrix
+            match ec.busy_get() {
+                Ok(0) | Err(Error::Protocol(_)) => return Ok(()),
+                Ok(_) => (),
+                Err(err) => return Err(err),
+            }
+        }
 
-    //TODO: remove unwraps
-    let firmware_data = fs::read(path).unwrap();
-    let firmware = Firmware::new(&firmware_data).unwrap();
+        if start.elapsed() >= timeout {
+            return Err(Error::Timeout);
+        }
+        thread::sleep(Duration::from_millis(10));
+    }
+}
+
+unsafe fn firmware_check(ec: &mut Ec<Box<dyn Access>>, firmware: &Firmware) -> Result<(), Error> {
     println!("file board: {:?}", str::from_utf8(firmware.board));
     println!("file version: {:?}", str::from_utf8(firmware.version));
 
@@ -168,10 +283,21 @@ unsafe fn flash(ec: &mut Ec<Box<dyn Access>>, path: &str, target: SpiTarget) ->
         println!("ec version: {:?}", str::from_utf8(ec_version));
     }
 
+    Ok(())
+}
+
+unsafe fn flash(ec: &mut Ec<Box<dyn Access>>, path: &str, target: SpiTarget) -> Result<(), Error> {
+    let scratch = true;
+
+    //TODO: remove unwraps
+    let firmware_data = fs::read(path).unwrap();
+    let firmware = Firmware::new(&firmware_data).unwrap();
+    firmware_check(ec, &firmware)?;
+
     if scratch {
-        // Wait for any key releases
-        eprintln!("Waiting 5 seconds for all keys to be released");
-        thread::sleep(Duration::new(5, 0));
+        // Keys held while in scratch ROM would stay pressed for the host
+        eprintln!("Waiting for all keys to be released");
+        wait_quiesced(ec, Duration::new(30, 0))?;
     }
 
     eprintln!("Sync");
@@ -184,18 +310,53 @@ unsafe fn flash(ec: &mut Ec<Box<dyn Access>>, path: &str, target: SpiTarget) ->
     let _ = process::Command::new("sync").status();
 
     if scratch {
-        eprintln!("System will shut off in 5 seconds");
-        thread::sleep(Duration::new(5, 0));
-
-        eprintln!("Sync");
-        let _ = process::Command::new("sync").status();
-
+        eprintln!("System will shut off");
         ec.reset()?;
     }
 
     res
 }
 
+unsafe fn update(ec: &mut Ec<Box<dyn Access>>, path: &str) -> Result<(), Error> {
+    //TODO: remove unwraps
+    let firmware_data = fs::read(path).unwrap();
+    let firmware = Firmware::new(&firmware_data).unwrap();
+    firmware_check(ec, &firmware)?;
+
+    // Trailing erased bytes do not need to be staged
+    let mut size = firmware.data.len();
+    while size > 0 && firmware.data[size - 1] == 0xFF {
+        size -= 1;
+    }
+    let data = &firmware.data[..size];
+    if data.len() > UPDATE_SLOT_SIZE {
+        eprintln!("Firmware is {} bytes, update slot is {} bytes", data.len(), UPDATE_SLOT_SIZE);
+        return Err(Error::DataLength(data.len()));
+    }
+
+    ec.update_begin()?;
+
+    for (i, chunk) in data.chunks(1024).enumerate() {
+        eprint!("\rUpdate Write {}K", i);
+        ec.update_write((i * 1024) as u32, chunk)?;
+    }
+    eprintln!("\rUpdate Write {}K", (data.len() + 1023) / 1024);
+
+    ec.update_commit(data.len() as u32, crc32(data))?;
+
+    eprintln!("Update Verify");
+    loop {
+        match ec.update_status()? {
+            UpdateState::Verifying => thread::sleep(Duration::from_millis(100)),
+            UpdateState::Ready => break,
+            _ => return Err(Error::Verify),
+        }
+    }
+
+    eprintln!("Update staged, it will be applied the next time the system is off and on AC");
+    Ok(())
+}
+
 unsafe fn info(ec: &mut Ec<Box<dyn Access>>) -> Result<(), Error> {
     let data_size = ec.access().data_size();
 
@@ -268,6 +429,71 @@ unsafe fn fan_set(ec: &mut Ec<Box<dyn Access>>, index: u8, duty: u8) -> Result<(
     ec.fan_set(index, duty)
 }
 
+unsafe fn fan_curve_get(ec: &mut Ec<Box<dyn Access>>, index: u8) -> Result<(), Error> {
+    let curve = ec.fan_curve_get(index)?;
+    println!("heatup: {}", curve.heatup);
+    println!("cooldown: {}", curve.cooldown);
+    println!("interpolate: {}", curve.interpolate);
+    println!("source: {}", match curve.source {
+        FanSource::Peci => "peci",
+        FanSource::Battery => "battery",
+        FanSource::Thermistor => "thermistor",
+    });
+    for (temp, duty) in curve.points.iter() {
+        println!("{}:{}", temp, duty);
+    }
+
+    Ok(())
+}
+
+// Settings that are not given keep their current value
+unsafe fn fan_curve_set(ec: &mut Ec<Box<dyn Access>>, index: u8, points: Option<Vec<(u8, u8)>>, heatup: Option<u8>, cooldown: Option<u8>, interpolate: Option<bool>, source: Option<FanSource>) -> Result<(), Error> {
+    let current = ec.fan_curve_get(index)?;
+    let curve = FanCurve {
+        heatup: heatup.unwrap_or(current.heatup),
+        cooldown: cooldown.unwrap_or(current.cooldown),
+        interpolate: interpolate.unwrap_or(current.interpolate),
+        source: source.unwrap_or(current.source),
+        points: points.unwrap_or(current.points),
+    };
+    ec.fan_curve_set(index, &curve)
+}
+
+unsafe fn power(ec: &mut Ec<Box<dyn Access>>) -> Result<(), Error> {
+    let (power, _energy, _unit) = ec.power_get()?;
+    println!("{}.{:03}", power / 1000, power % 1000);
+
+    Ok(())
+}
+
+unsafe fn battery_log(ec: &mut Ec<Box<dyn Access>>) -> Result<(), Error> {
+    let (samples, _interval) = ec.battery_log_get()?;
+    println!("time,voltage,current,temperature,charge,status,charge_state");
+    for BatterySample { time, voltage, current, temp, status, charge, charge_state } in samples {
+        let sign = if temp < 0 { "-" } else { "" };
+        let temp = (temp as i32).abs();
+        println!(
+            "{},{},{},{}{}.{},{},0x{:04X},{}",
+            time, voltage, current, sign, temp / 10, temp % 10, charge, status, charge_state
+        );
+    }
+
+    Ok(())
+}
+
+unsafe fn battery_time(ec: &mut Ec<Box<dyn Access>>) -> Result<(), Error> {
+    let (power, charging, empty, full) = ec.battery_time_get()?;
+    let minutes = |value: Option<u16>| match value {
+        Some(value) => format!("{}:{:02}", value / 60, value % 60),
+        None => "unknown".to_string(),
+    };
+    println!("power: {}{}.{:03} W", if charging { "+" } else { "-" }, power / 1000, power % 1000);
+    println!("empty: {}", minutes(empty));
+    println!("full: {}", minutes(full));
+
+    Ok(())
+}
+
 unsafe fn keymap_get(ec: &mut Ec<Box<dyn Access>>, layer: u8, output: u8, input: u8) -> Result<(), Error> {
     let value = ec.keymap_get(layer, output, input)?;
     println!("{:04X}", value);
@@ -296,6 +522,17 @@ fn parse_color(s: &str) -> Result<(u8, u8, u8), String> {
     }
 }
 
+// Parse a fan curve point as temperature in degrees C and duty in percent
+fn parse_fan_point(s: &str) -> Result<(u8, u8), String> {
+    let mut parts = s.splitn(2, ':');
+    let temp = parts.next().map(|x| x.parse::<u8>());
+    let duty = parts.next().map(|x| x.parse::<u8>());
+    match (temp, duty) {
+        (Some(Ok(temp)), Some(Ok(duty))) if duty <= 100 => Ok((temp, duty)),
+        _ => Err(format!("Invalid fan point '{}', expected TEMP:DUTY", s)),
+    }
+}
+
 fn main() {
     let matches = App::new("system76_ectool")
         .setting(AppSettings::SubcommandRequired)
@@ -304,6 +541,17 @@ fn main() {
             .possible_values(&["lpc-linux", "lpc-sim", "hid"])
             .default_value("lpc-linux")
         )
+        .subcommand(SubCommand::with_name("battery_log")
+            .alias("battery-log")
+            .arg(Arg::with_name("interval")
+                .long("interval")
+                .takes_value(true)
+                .validator(validate_from_str::<u16>)
+            )
+        )
+        .subcommand(SubCommand::with_name("battery_time")
+            .alias("battery-time")
+        )
         .subcommand(SubCommand::with_name("console"))
         .subcommand(SubCommand::with_name("fan")
             .arg(Arg::with_name("index")
@@ -314,6 +562,46 @@ fn main() {
                 .validator(validate_from_str::<u8>)
             )
         )
+        .subcommand(SubCommand::with_name("fan_curve")
+            .alias("fan-curve")
+            .setting(AppSettings::SubcommandRequired)
+            .subcommand(SubCommand::with_name("get")
+                .arg(Arg::with_name("index")
+                    .validator(validate_from_str::<u8>)
+                    .required(true)
+                )
+            )
+            .subcommand(SubCommand::with_name("set")
+                .arg(Arg::with_name("index")
+                    .validator(validate_from_str::<u8>)
+                    .required(true)
+                )
+                .arg(Arg::with_name("points")
+                    .validator(|x| parse_fan_point(&x).and(Ok(())))
+                    .multiple(true)
+                )
+                .arg(Arg::with_name("heatup")
+                    .long("heatup")
+                    .takes_value(true)
+                    .validator(validate_from_str::<u8>)
+                )
+                .arg(Arg::with_name("cooldown")
+                    .long("cooldown")
+                    .takes_value(true)
+                    .validator(validate_from_str::<u8>)
+                )
+                .arg(Arg::with_name("interpolate")
+                    .long("interpolate")
+                    .takes_value(true)
+                    .validator(validate_from_str::<bool>)
+                )
+                .arg(Arg::with_name("source")
+                    .long("source")
+                    .takes_value(true)
+                    .possible_values(&["peci", "battery", "thermistor"])
+                )
+            )
+        )
         .subcommand(SubCommand::with_name("flash")
             .arg(Arg::with_name("path")
                 .required(true)
@@ -373,12 +661,18 @@ fn main() {
         )
         .subcommand(SubCommand::with_name("led_save"))
         .subcommand(SubCommand::with_name("matrix"))
+        .subcommand(SubCommand::with_name("power"))
         .subcommand(SubCommand::with_name("print")
             .arg(Arg::with_name("message")
                 .required(true)
                 .multiple(true)
             )
         )
+        .subcommand(SubCommand::with_name("update")
+            .arg(Arg::with_name("path")
+                .required(true)
+            )
+        )
         .get_matches();
 
     let get_ec = || -> Result<_, Error> {
@@ -420,6 +714,32 @@ fn main() {
     };
 
     match matches.subcommand() {
+        ("battery_log", Some(sub_m)) => match sub_m.value_of("interval") {
+            Some(interval) => {
+                let interval = interval.parse::<u16>().unwrap();
+                match unsafe { ec.battery_log_set(interval) } {
+                    Ok(()) => (),
+                    Err(err) => {
+                        eprintln!("failed to set battery log interval: {:X?}", err);
+                        process::exit(1);
+                    },
+                }
+            },
+            None => match unsafe { battery_log(&mut ec) } {
+                Ok(()) => (),
+                Err(err) => {
+                    eprintln!("failed to read battery log: {:X?}", err);
+                    process::exit(1);
+                },
+            },
+        },
+        ("battery_time", Some(_sub_m)) => match unsafe { battery_time(&mut ec) } {
+            Ok(()) => (),
+            Err(err) => {
+                eprintln!("failed to read battery time: {:X?}", err);
+                process::exit(1);
+            },
+        },
         ("console", Some(_sub_m)) => match unsafe { console(&mut ec) } {
             Ok(()) => (),
             Err(err) => {
@@ -447,6 +767,39 @@ fn main() {
                 },
             }
         },
+        ("fan_curve", Some(sub_m)) => match sub_m.subcommand() {
+            ("get", Some(sub_m)) => {
+                let index = sub_m.value_of("index").unwrap().parse::<u8>().unwrap();
+                match unsafe { fan_curve_get(&mut ec, index) } {
+                    Ok(()) => (),
+                    Err(err) => {
+                        eprintln!("failed to get fan {} curve: {:X?}", index, err);
+                        process::exit(1);
+                    },
+                }
+            },
+            ("set", Some(sub_m)) => {
+                let index = sub_m.value_of("index").unwrap().parse::<u8>().unwrap();
+                let points = sub_m.values_of("points").map(|x| x.map(|x| parse_fan_point(x).unwrap()).collect());
+                let heatup = sub_m.value_of("heatup").map(|x| x.parse::<u8>().unwrap());
+                let cooldown = sub_m.value_of("cooldown").map(|x| x.parse::<u8>().unwrap());
+                let interpolate = sub_m.value_of("interpolate").map(|x| x.parse::<bool>().unwrap());
+                let source = sub_m.value_of("source").map(|x| match x {
+                    "peci" => FanSource::Peci,
+                    "battery" => FanSource::Battery,
+                    "thermistor" => FanSource::Thermistor,
+                    _ => unreachable!(),
+                });
+                match unsafe { fan_curve_set(&mut ec, index, points, heatup, cooldown, interpolate, source) } {
+                    Ok(()) => (),
+                    Err(err) => {
+                        eprintln!("failed to set fan {} curve: {:X?}", index, err);
+                        process::exit(1);
+                    },
+                }
+            },
+            _ => unreachable!(),
+        },
         ("flash", Some(sub_m)) => {
             let path = sub_m.value_of("path").unwrap();
             match unsafe { flash(&mut ec, &path, SpiTarget::Main) } {
@@ -586,6 +939,13 @@ fn main() {
                 process::exit(1);
             },
         },
+        ("power", Some(_sub_m)) => match unsafe { power(&mut ec) } {
+            Ok(()) => (),
+            Err(err) => {
+                eprintln!("failed to read power: {:X?}", err);
+                process::exit(1);
+            },
+        },
         ("print", Some(sub_m)) => for arg in sub_m.values_of("message").unwrap() {
             let mut arg = arg.to_owned();
             arg.push('\n');
@@ -597,6 +957,16 @@ fn main() {
                 },
             }
         },
+        ("update", Some(sub_m)) => {
+            let path = sub_m.value_of("path").unwrap();
+            match unsafe { update(&mut ec, path) } {
+                Ok(()) => (),
+                Err(err) => {
+                    eprintln!("failed to stage update '{}': {:X?}", path, err);
+                    process::exit(1);
+                },
+            }
+        },
         _ => unreachable!()
     }
 }
@@ -18,6 +18,13 @@ pub trait Spi {
 
     /// Write data to the SPI bus
     unsafe fn write(&mut self, data: &[u8]) -> Result<usize, Error>;
+
+    /// Program a sector at `address` from `data`, erasing it first if `erase`
+    /// is set. The whole sector is buffered and verified by the EC. Returns
+    /// the number of bytes programmed
+    unsafe fn program_sector(&mut self, _address: u32, _data: &[u8], _erase: bool) -> Result<usize, Error> {
+        Err(Error::NotSupported)
+    }
 }
 
 /// Target which will receive SPI commands
@@ -29,6 +36,17 @@ pub enum SpiTarget {
     Backup,
 }
 
+impl SpiTarget {
+    /// Get sector size in bytes
+    pub fn sector_size(&self) -> usize {
+        //TODO: can this be determined automatically?
+        match self {
+            SpiTarget::Main => 1024,
+            SpiTarget::Backup => 4096,
+        }
+    }
+}
+
 /// SPI ROM transactions
 pub struct SpiRom<'a, S: Spi, T: Timeout> {
     spi: &'a mut S,
@@ -46,11 +64,7 @@ impl<'a, S: Spi, T: Timeout> SpiRom<'a, S, T> {
 
     /// Get sector size in bytes
     pub fn sector_size(&self) -> usize {
-        //TODO: can this be determined automatically?
-        match self.spi.target() {
-            SpiTarget::Main => 1024,
-            SpiTarget::Backup => 4096,
-        }
+        self.spi.target().sector_size()
     }
 
     /// Read the status register
@@ -126,6 +140,15 @@ impl<'a, S: Spi, T: Timeout> SpiRom<'a, S, T> {
         Ok(())
     }
 
+    /// Erase and program a whole sector in one operation on the EC, if supported
+    pub unsafe fn program_sector(&mut self, address: u32, data: &[u8], erase: bool) -> Result<usize, Error> {
+        if (address & 0xFF00_0000) > 0 || data.len() > self.sector_size() {
+            return Err(Error::Parameter);
+        }
+
+        self.spi.program_sector(address, data, erase)
+    }
+
     /// Read at a specific address
     pub unsafe fn read_at(&mut self, address: u32, data: &mut [u8]) -> Result<usize, Error> {
         if (address & 0xFF00_0000) > 0 {